@@ -0,0 +1,173 @@
+// On-device microbenchmarks for the firmware hot paths, built by the bench
+// environment instead of the normal setup()/loop():
+//
+//   pio run -e bench -t upload && pio device monitor
+//
+// Each result is one JSON line prefixed with "BENCH ", cycle counts come
+// from ESP.getCycleCount() per iteration. The HTTP benchmark only runs if
+// WiFi credentials and a server URL are stored on the device.
+
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <Wire.h>
+
+#include "connection.h"
+#include "fan.h"
+#include "frame.h"
+#include "global.h"
+#include "led.h"
+#include "logger.h"
+#include "tasks.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Keeps results alive so the compiler can't drop the measured code
+static volatile uint32_t sink = 0;
+
+// prepare(i) runs before each iteration, outside the timed region
+template <typename F, typename P>
+static void bench(const char *name, uint32_t iterations, F fn, P prepare) {
+  uint32_t min_cycles = UINT32_MAX, max_cycles = 0;
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < iterations; i++) {
+    prepare(i);
+    uint32_t start = ESP.getCycleCount();
+    fn(i);
+    uint32_t cycles = ESP.getCycleCount() - start;
+    total += cycles;
+    min_cycles = min(min_cycles, cycles);
+    max_cycles = max(max_cycles, cycles);
+  }
+  uint32_t mhz = getCpuFrequencyMhz();
+  uint32_t mean = total / iterations;
+  Serial.printf("BENCH {\"name\":\"%s\",\"iterations\":%lu,\"min\":%lu,"
+                "\"mean\":%lu,\"max\":%lu,\"mhz\":%lu,\"mean_us\":%.3f}\n",
+                name, (unsigned long)iterations, (unsigned long)min_cycles,
+                (unsigned long)mean, (unsigned long)max_cycles,
+                (unsigned long)mhz, (float)mean / mhz);
+}
+
+template <typename F>
+static void bench(const char *name, uint32_t iterations, F fn) {
+  bench(name, iterations, fn, [](uint32_t) {});
+}
+
+static void benchColor() {
+  bench("hsl", 1000, [](uint32_t i) {
+    CRGB c = hsl((i % 256) / 255.0f, 1.0f, 0.5f);
+    sink += c.r + c.g + c.b;
+  });
+  bench("hsl8", 1000, [](uint32_t i) {
+    CRGB c = hsl8(i, 255, 128);
+    sink += c.r + c.g + c.b;
+  });
+}
+
+static void benchTach() {
+  static const char *names[] = {"rpm_isr", "rpm_pcnt", "rpm_period"};
+  for (uint8_t mode = TACH_ISR; mode <= TACH_PERIOD; mode++) {
+    beginFanTach((TachMode)mode);
+    bench(names[mode], 1000,
+          [](uint32_t) { sink += (uint32_t)fan_pulse_counters[0].rpm(); });
+  }
+  beginFanTach((TachMode)config.tach_mode);
+}
+
+static void benchSampler() {
+  Status sample;
+  // Pipelined high repeatability, one call per conversion time, the wait
+  // for the conversion isn't timed
+  bench(
+      "status_update", 20,
+      [&](uint32_t) { sink += (uint32_t)sample.update(false).temperature; },
+      [](uint32_t) { delay(20); });
+  bench("status_update_low", 20, [&](uint32_t) {
+    sink += (uint32_t)sample.update(true).temperature;
+  });
+}
+
+static void benchLog() {
+  LogRecord record;
+  // Queueing cost only, nothing drains the buffer while measuring
+  bench("log", 20, [](uint32_t i) { log(LOG_INFO, "bench"); });
+  while (nextLogRecord(record, 0))
+    ;
+  bench("log_format", 20, [](uint32_t i) {
+    log(LOG_INFO, "bench %lu %.2f", (unsigned long)i, i * 0.5f);
+  });
+  // Consumer side, what the console task pays per record before printing
+  bench("log_drain", 20, [&](uint32_t) {
+    sink += nextLogRecord(record, 0) ? record.timestamp : 0;
+  });
+}
+
+static void benchFrames() {
+  Status sample;
+  sample.temperature = 23.45f;
+  sample.humidity = 45.6f;
+  sample.fan_rpm = 1234.0f;
+  sample.fan_power = 0.5f;
+  static uint8_t buf[FRAME_BATCH_MAX_SIZE];
+  bench("encode_status", 1000, [&](uint32_t i) {
+    sink += encodeStatus(sample, i, 1, nullptr, buf, FRAME_MAX_SIZE);
+  });
+  bench("encode_batch", 100, [&](uint32_t i) {
+    BatchWriter batch(buf, sizeof(buf), i, millis());
+    BatchRecord record = batchRecord(sample);
+    while (batch.add(record))
+      record.uptime += 1000;
+    sink += batch.size();
+  });
+}
+
+static void benchPost() {
+  if (strlen(config.ssid) == 0 || strncmp(config.server, "http://", 7) != 0) {
+    Serial.println("BENCH {\"name\":\"http_post\",\"skipped\":true}");
+    return;
+  }
+  xTaskCreatePinnedToCore(connectionTask, "Connection", STACK_CONNECTION,
+                          NULL, PRIORITY_CONNECTION, NULL, CORE_NETWORK);
+  if (!waitForWiFi(pdMS_TO_TICKS(20000))) {
+    Serial.println("BENCH {\"name\":\"http_post\",\"skipped\":true}");
+    return;
+  }
+  Status sample;
+  uint8_t frame[FRAME_MAX_SIZE];
+  WiFiClient client;
+  HTTPClient http;
+  http.setReuse(true);
+  // Keep-alive round trips, same as the telemetry session
+  bench("http_post", 20, [&](uint32_t i) {
+    size_t length = encodeStatus(sample, i, 0, nullptr, frame, sizeof(frame));
+    http.begin(client, config.server);
+    http.addHeader("Content-Type", "application/octet-stream");
+    sink += http.POST(frame, length);
+    http.getString();
+    http.end();
+  });
+}
+
+void setup() {
+  Serial.begin(115200);
+  beginLog();
+  config.load();
+  Wire.begin(IIC_SDA, IIC_SCL);
+  beginSensors();
+  FastLED.addLeds<NEOPIXEL, LED_PIN>(leds, NUM_LEDS);
+  WiFi.mode(WIFI_STA);
+  beginConnection();
+  beginFanTach((TachMode)config.tach_mode);
+  // Let the serial monitor attach
+  delay(2000);
+  Serial.println("BENCH {\"start\":true}");
+  benchColor();
+  benchTach();
+  benchSampler();
+  benchLog();
+  benchFrames();
+  benchPost();
+  Serial.println("BENCH {\"done\":true}");
+}
+
+void loop() { vTaskDelete(NULL); }
@@ -0,0 +1,125 @@
+#include "global.h"
+
+#include <freertos/FreeRTOS.h>
+
+// Guards config against concurrent reads while the console writes. NVS is
+// accessed through a Preferences instance per call, a shared one would
+// close another task's namespace.
+static portMUX_TYPE config_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void readString(Preferences &preferences, const char *key, char *dst,
+                       size_t size) {
+  String value = preferences.getString(key, "");
+  strlcpy(dst, value.c_str(), size);
+}
+
+void Config::load() {
+  Config loaded;
+  Preferences preferences;
+  preferences.begin("wifi", true);
+  readString(preferences, "ssid", loaded.ssid, sizeof(loaded.ssid));
+  readString(preferences, "passwd", loaded.passwd,
+             sizeof(loaded.passwd));
+  loaded.wifi_static = preferences.getBool("static", loaded.wifi_static);
+  preferences.end();
+  preferences.begin("config", true);
+  readString(preferences, "server", loaded.server,
+             sizeof(loaded.server));
+  readString(preferences, "domain", loaded.domain,
+             sizeof(loaded.domain));
+  loaded.sample_interval =
+      preferences.getUInt("sample_ms", loaded.sample_interval);
+  loaded.sensor_low_repeatability =
+      preferences.getBool("sensor_low", loaded.sensor_low_repeatability);
+  loaded.tach_mode = preferences.getUChar("tach", loaded.tach_mode);
+  loaded.fan_closed_loop =
+      preferences.getBool("fan_closed", loaded.fan_closed_loop);
+  loaded.fan_pwm_freq = preferences.getUInt("pwm_freq", loaded.fan_pwm_freq);
+  loaded.fan_pwm_bits = preferences.getUChar("pwm_bits", loaded.fan_pwm_bits);
+  loaded.fan_channels =
+      preferences.getUChar("fan_channels", loaded.fan_channels);
+  loaded.fan_ramp = preferences.getUInt("fan_ramp_ms", loaded.fan_ramp);
+  loaded.relay_mode = preferences.getUChar("relay", loaded.relay_mode);
+  loaded.report_heartbeat =
+      preferences.getUInt("heartbeat", loaded.report_heartbeat);
+  loaded.transport = preferences.getUChar("transport", loaded.transport);
+  loaded.deadband_temperature =
+      preferences.getFloat("db_temp", loaded.deadband_temperature);
+  loaded.deadband_humidity =
+      preferences.getFloat("db_hum", loaded.deadband_humidity);
+  loaded.deadband_rpm = preferences.getFloat("db_rpm", loaded.deadband_rpm);
+  loaded.power_save = preferences.getBool("power_save", loaded.power_save);
+  loaded.log_level = preferences.getUChar("log_level", loaded.log_level);
+  loaded.perf_telemetry = preferences.getBool("perf_tx", loaded.perf_telemetry);
+  preferences.end();
+
+  portENTER_CRITICAL(&config_lock);
+  loaded.revision = revision + 1;
+  *this = loaded;
+  portEXIT_CRITICAL(&config_lock);
+}
+
+void Config::save(const char *ns, const char *key, const char *value) {
+  Preferences preferences;
+  preferences.begin(ns, false);
+  preferences.putString(key, value);
+  preferences.end();
+  load();
+}
+
+void Config::save(const char *ns, const char *key, uint32_t value) {
+  Preferences preferences;
+  preferences.begin(ns, false);
+  preferences.putUInt(key, value);
+  preferences.end();
+  load();
+}
+
+void Config::save(const char *ns, const char *key, bool value) {
+  Preferences preferences;
+  preferences.begin(ns, false);
+  preferences.putBool(key, value);
+  preferences.end();
+  load();
+}
+
+void Config::save(const char *ns, const char *key, uint8_t value) {
+  Preferences preferences;
+  preferences.begin(ns, false);
+  preferences.putUChar(key, value);
+  preferences.end();
+  load();
+}
+
+void Config::save(const char *ns, const char *key, float value) {
+  Preferences preferences;
+  preferences.begin(ns, false);
+  preferences.putFloat(key, value);
+  preferences.end();
+  load();
+}
+
+void Config::wipe() {
+  Preferences preferences;
+  preferences.begin("wifi", false);
+  preferences.clear();
+  preferences.end();
+  preferences.begin("config", false);
+  preferences.clear();
+  preferences.end();
+  preferences.begin("curve", false);
+  preferences.clear();
+  preferences.end();
+  load();
+}
+
+bool Config::refresh(Config &local) const {
+  bool changed = false;
+  portENTER_CRITICAL(&config_lock);
+  if (local.revision != revision) {
+    local = *this;
+    changed = true;
+  }
+  portEXIT_CRITICAL(&config_lock);
+  return changed;
+}
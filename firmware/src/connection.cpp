@@ -1,52 +1,226 @@
 #include "connection.h"
-#include "console.h"
 #include "global.h"
+#include "led.h"
+#include "logger.h"
+#include "perf.h"
+#include "power.h"
 #include <WiFi.h>
+#include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
+#include <freertos/event_groups.h>
 
-void ensureWiFi() {
-  // Return immediately if already connected
-  if (WiFi.status() == WL_CONNECTED)
+// Event group bits set from WiFi events
+#define WIFI_CONNECTED_BIT BIT0
+#define WIFI_FAILED_BIT BIT1
+
+// Join timeouts, a fast join skips the scan and should be quick
+#define WIFI_FAST_JOIN_TIMEOUT_MS 3000
+#define WIFI_FULL_JOIN_TIMEOUT_MS 10000
+
+// Retry backoff after failed joins, doubles up to the limit
+#define WIFI_BACKOFF_BASE_MS 500
+#define WIFI_BACKOFF_MAX_MS 30000
+
+// Last successful association, cached in NVS so reconnects can skip the
+// channel scan (and DHCP if static IP reuse is enabled)
+struct FastJoin {
+  char ssid[33] = "";
+  uint8_t bssid[6] = {};
+  uint8_t channel = 0;
+  uint32_t ip = 0;
+  uint32_t gateway = 0;
+  uint32_t subnet = 0;
+  uint32_t dns = 0;
+
+  bool valid() const { return channel != 0; }
+  bool operator!=(const FastJoin &other) const {
+    return memcmp(this, &other, sizeof(FastJoin)) != 0;
+  }
+};
+
+static EventGroupHandle_t wifi_events = nullptr;
+static FastJoin fast_join;
+static volatile WiFiState state = WIFI_WAITING_CREDENTIALS;
+
+static void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  switch (event) {
+  case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+    xEventGroupClearBits(wifi_events, WIFI_FAILED_BIT);
+    xEventGroupSetBits(wifi_events, WIFI_CONNECTED_BIT);
+    break;
+  case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+  case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+    xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT);
+    xEventGroupSetBits(wifi_events, WIFI_FAILED_BIT);
+    break;
+  default:
+    break;
+  }
+}
+
+void beginConnection() { wifi_events = xEventGroupCreate(); }
+
+static void beginWiFi() {
+  // Reconnects are driven from here, not by the core
+  WiFi.setAutoReconnect(false);
+  WiFi.onEvent(onWiFiEvent);
+  Preferences preferences;
+  preferences.begin("wifi", true);
+  if (preferences.getBytesLength("fast") == sizeof(FastJoin))
+    preferences.getBytes("fast", &fast_join, sizeof(FastJoin));
+  preferences.end();
+}
+
+// Remember the association that just succeeded, NVS is only written if it
+// changed
+static void saveFastJoin(const char *ssid) {
+  FastJoin current;
+  strlcpy(current.ssid, ssid, sizeof(current.ssid));
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.channel = WiFi.channel();
+  current.ip = WiFi.localIP();
+  current.gateway = WiFi.gatewayIP();
+  current.subnet = WiFi.subnetMask();
+  current.dns = WiFi.dnsIP(0);
+  if (!(current != fast_join))
+    return;
+  fast_join = current;
+  Preferences preferences;
+  preferences.begin("wifi", false);
+  preferences.putBytes("fast", &fast_join, sizeof(FastJoin));
+  preferences.end();
+}
+
+static void setState(WiFiState next) {
+  if (next == state)
     return;
+  bool was_connected = state == WIFI_CONNECTED;
+  state = next;
+  if (was_connected != (next == WIFI_CONNECTED))
+    ledSignal(LED_EVENT_WIFI, next == WIFI_CONNECTED);
+}
 
-  String ssid = "";
-  String passwd = "";
+// Abort the current link or join, waits for its disconnect event so it is not
+// mistaken for the failure of the next attempt
+static void dropLink() {
+  WiFi.disconnect();
+  xEventGroupWaitBits(wifi_events, WIFI_FAILED_BIT, pdFALSE, pdFALSE,
+                      pdMS_TO_TICKS(200));
+}
 
-  // Block until valid WiFi credentials are configured
-  while (true) {
-    preferences.begin("wifi", true);
-    ssid = preferences.getString("ssid", "");
-    passwd = preferences.getString("passwd", "");
-    preferences.end();
-    if (ssid.length() > 0) {
-      break;
-    }
-    log("Waiting for WiFi credentials to be configured...");
-    vTaskDelay(pdMS_TO_TICKS(2000));
+// Exponential backoff with jitter, keeps units on the same AP from retrying
+// in lockstep after an outage
+static uint32_t backoffDelay(uint32_t failures) {
+  uint32_t limit = WIFI_BACKOFF_MAX_MS;
+  if (failures < 16)
+    limit = min(limit, (uint32_t)WIFI_BACKOFF_BASE_MS << failures);
+  return limit / 2 + esp_random() % (limit / 2 + 1);
+}
+
+// Start a join with the listen interval set, WiFi.begin() resets it to the
+// default of 3 beacons. Only low-power mode sleeps that long.
+static void join(const Config &local, bool fast) {
+  if (fast)
+    WiFi.begin(local.ssid, local.passwd, fast_join.channel, fast_join.bssid,
+               false);
+  else
+    WiFi.begin(local.ssid, local.passwd, 0, nullptr, false);
+  wifi_config_t conf;
+  if (esp_wifi_get_config(WIFI_IF_STA, &conf) == ESP_OK) {
+    conf.sta.listen_interval = WIFI_LISTEN_INTERVAL;
+    esp_wifi_set_config(WIFI_IF_STA, &conf);
   }
+  esp_wifi_connect();
+}
+
+static bool credentialsChanged(const Config &a, const Config &b) {
+  return strcmp(a.ssid, b.ssid) != 0 || strcmp(a.passwd, b.passwd) != 0;
+}
 
-  // Try to connect
-  while (WiFi.status() != WL_CONNECTED) {
-    wifi_connected = false;
-    // Reload credentials on each retry
-    preferences.begin("wifi", true);
-    ssid = preferences.getString("ssid", "");
-    passwd = preferences.getString("passwd", "");
-    preferences.end();
-
-    if (ssid.length() == 0) {
-      log("WiFi credentials missing...");
+void connectionTask(void *parameter) {
+  // Local copy of the cached credentials, refreshed when the console changes
+  // them
+  Config local;
+  uint32_t failures = 0;
+  beginWiFi();
+  while (true) {
+    config.refresh(local);
+
+    // Wait for valid WiFi credentials to be configured
+    if (strlen(local.ssid) == 0) {
+      setState(WIFI_WAITING_CREDENTIALS);
+      log(LOG_INFO, "Waiting for WiFi credentials to be configured...");
       vTaskDelay(pdMS_TO_TICKS(2000));
       continue;
     }
 
-    log("Connecting to WiFi: " + ssid);
-    WiFi.begin(ssid.c_str(), passwd.c_str());
-    if (WiFi.status() != WL_CONNECTED) {
-      // Retry after 1 second
-      vTaskDelay(pdMS_TO_TICKS(1000));
+    bool fast = fast_join.valid() && strcmp(fast_join.ssid, local.ssid) == 0;
+    if (fast && local.wifi_static && fast_join.ip != 0) {
+      // Reuse the previous lease, skips DHCP
+      WiFi.config(IPAddress(fast_join.ip), IPAddress(fast_join.gateway),
+                  IPAddress(fast_join.subnet), IPAddress(fast_join.dns));
+    } else {
+      WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0),
+                  IPAddress((uint32_t)0));
     }
+    log(LOG_INFO, "Connecting to WiFi: %s%s", local.ssid, fast ? " (fast)" : "");
+    setState(WIFI_CONNECTING);
+    xEventGroupClearBits(wifi_events, WIFI_FAILED_BIT);
+    int64_t started = esp_timer_get_time();
+    join(local, fast);
+
+    // Block until the join succeeds, fails or times out
+    unsigned long timeout =
+        fast ? WIFI_FAST_JOIN_TIMEOUT_MS : WIFI_FULL_JOIN_TIMEOUT_MS;
+    EventBits_t bits =
+        xEventGroupWaitBits(wifi_events, WIFI_CONNECTED_BIT | WIFI_FAILED_BIT,
+                            pdFALSE, pdFALSE, pdMS_TO_TICKS(timeout));
+
+    if (bits & WIFI_CONNECTED_BIT) {
+      uint32_t join_us = esp_timer_get_time() - started;
+      perfRecord(PERF_WIFI_JOIN, join_us);
+      log(LOG_INFO, "WiFi connected in %lu ms%s", (unsigned long)join_us / 1000,
+          fast ? " (fast)" : "");
+      saveFastJoin(local.ssid);
+      failures = 0;
+      setState(WIFI_CONNECTED);
+      // Sleep until the link drops, waking once a second for new credentials
+      Config current = local;
+      while (!(xEventGroupWaitBits(wifi_events, WIFI_FAILED_BIT, pdFALSE,
+                                   pdFALSE, pdMS_TO_TICKS(1000)) &
+               WIFI_FAILED_BIT)) {
+        if (config.refresh(current) && credentialsChanged(current, local))
+          break;
+      }
+      log(LOG_WARN, "WiFi disconnected");
+      perfCount(PERF_RECONNECTS);
+      dropLink();
+      continue;
+    }
+
+    dropLink();
+    if (fast) {
+      // Cached AP moved or went away, fall back to a full scan right away
+      log(LOG_WARN, "Fast reconnect failed, scanning...");
+      fast_join.channel = 0;
+      continue;
+    }
+    uint32_t delay_ms = backoffDelay(failures++);
+    log(LOG_WARN, "WiFi join failed, retrying in %lu ms",
+        (unsigned long)delay_ms);
+    setState(WIFI_BACKOFF);
+    vTaskDelay(pdMS_TO_TICKS(delay_ms));
   }
-  wifi_connected = true;
 }
+
+bool wifiConnected() {
+  return xEventGroupGetBits(wifi_events) & WIFI_CONNECTED_BIT;
+}
+
+bool waitForWiFi(TickType_t ticks) {
+  return xEventGroupWaitBits(wifi_events, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE,
+                             ticks) &
+         WIFI_CONNECTED_BIT;
+}
+
+WiFiState wifiState() { return state; }
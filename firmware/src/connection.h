@@ -1,4 +1,26 @@
 #pragma once
 
-// WiFi connection management
-void ensureWiFi();
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+enum WiFiState {
+  WIFI_WAITING_CREDENTIALS,
+  WIFI_CONNECTING,
+  WIFI_CONNECTED,
+  WIFI_BACKOFF,
+};
+
+// Create the connection state, call once in setup() before starting tasks
+void beginConnection();
+
+// Connection manager, joins and rejoins the configured network driven by WiFi
+// events
+void connectionTask(void *parameter);
+
+// Non-blocking check of the connected bit
+bool wifiConnected();
+
+// Block until connected or the timeout expires, returns true when connected
+bool waitForWiFi(TickType_t ticks);
+
+WiFiState wifiState();
@@ -1,341 +1,770 @@
 #include "console.h"
 
+#include <atomic>
 #include <cmath>
 #include <global.h>
 
+#include "connection.h"
+#include "fan.h"
+#include "led.h"
+#include "ota.h"
+#include "perf.h"
+#include "power.h"
+#include "relay.h"
+#include "ring.h"
+#include "tasks.h"
+#include "telemetry.h"
+
 #include <ESP32Ping.h>
 #include <WiFi.h>
+#include <esp_ota_ops.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 #include <freertos/task.h>
 
-static String current_input = "";
-static String last_log_message = "";
-static int log_repeat_count = 0;
-
-// Log function that preserves the interactive prompt
-void log(const String &message) {
-  // Check if this is a repeat of the last message
-  if (message == last_log_message) {
-    log_repeat_count++;
-    // Erase the previous line with count
-    int total_chars = 2 + current_input.length();
-    for (int i = 0; i < total_chars; i++) {
-      Serial.print("\b \b");
+static char line[CONSOLE_LINE_MAX] = "";
+static size_t line_length = 0;
+// Printed log lines, replayed by "log dump"
+static RingBuffer<LogRecord, LOG_HISTORY> history;
+
+static void printRecord(const LogRecord &record, int repeat) {
+  if (record.level == LOG_CONSOLE) {
+    Serial.println(record.message);
+    return;
+  }
+  Serial.printf("[%6lu.%03lu] %c %s", (unsigned long)(record.timestamp / 1000),
+                (unsigned long)(record.timestamp % 1000),
+                "DIWE"[record.level & 3], record.message);
+  if (repeat > 1)
+    Serial.printf(" (%d)", repeat);
+  Serial.println();
+}
+
+// Print queued log records, waits up to ticks for the first one. Clears the
+// prompt line once per burst and redraws it after.
+static void drainLog(uint32_t ticks) {
+  static char last_message[LOG_MESSAGE_MAX] = "";
+  static int repeat_count = 0;
+  LogRecord record;
+  bool erased = false;
+  while (nextLogRecord(record, erased ? 0 : ticks)) {
+    if (!erased) {
+      Serial.print("\r\033[K");
+      erased = true;
+    }
+    // Command output, not a log line
+    if (record.level == LOG_CONSOLE) {
+      printRecord(record, 1);
+      continue;
     }
-    // Print updated message with count
-    Serial.print(message);
-    Serial.print(" (");
-    Serial.print(log_repeat_count);
-    Serial.println(")");
-    // Restore prompt and current input
+    // Repeated messages are printed with a counter
+    if (strcmp(record.message, last_message) == 0) {
+      repeat_count++;
+    } else {
+      strlcpy(last_message, record.message, sizeof(last_message));
+      repeat_count = 1;
+      history.push(record);
+    }
+    printRecord(record, repeat_count);
+  }
+  uint32_t dropped = takeDroppedLogs();
+  if (dropped > 0) {
+    if (!erased)
+      Serial.print("\r\033[K");
+    Serial.printf("(%lu log messages dropped)\n", (unsigned long)dropped);
+    last_message[0] = '\0';
+    erased = true;
+  }
+  if (erased) {
     Serial.print("> ");
-    Serial.print(current_input);
+    Serial.print(line);
+  }
+}
+
+// Split the next space-separated token off s, nullptr at the end
+static char *nextToken(char *&s) {
+  while (*s == ' ')
+    s++;
+  if (*s == '\0')
+    return nullptr;
+  char *token = s;
+  while (*s && *s != ' ')
+    s++;
+  if (*s)
+    *s++ = '\0';
+  return token;
+}
+
+typedef void (*CommandHandler)(char *arg);
+
+struct Command {
+  const char *name;
+  const char *usage;
+  const char *help;
+  CommandHandler handler;
+  bool async; // Runs on the worker task, may block
+};
+
+// Long-running command queued for the worker, with a copy of its argument
+struct ConsoleJob {
+  CommandHandler handler;
+  char arg[CONSOLE_LINE_MAX];
+};
+
+static QueueHandle_t jobs = nullptr;
+// Set from queueing a job until the worker finished it, a command arriving
+// meanwhile is rejected rather than queued behind it
+static std::atomic<bool> job_busy{false};
+
+static void cmdHelp(char *arg);
+
+static void cmdWifiStatus(char *arg) {
+  Serial.print("WiFi Status: ");
+  if (wifiConnected()) {
+    Serial.println("Connected");
+    Serial.printf("SSID: %s\n", WiFi.SSID().c_str());
+    Serial.print("IP Address: ");
+    Serial.println(WiFi.localIP());
+    Serial.printf("Signal Strength: %d dBm\n", WiFi.RSSI());
+  } else if (wifiState() == WIFI_WAITING_CREDENTIALS) {
+    Serial.println("Waiting for credentials");
+  } else if (wifiState() == WIFI_BACKOFF) {
+    Serial.println("Disconnected (retry pending)");
+  } else {
+    Serial.println("Connecting");
+  }
+  Serial.printf("MAC Address: %s\n", WiFi.macAddress().c_str());
+}
+
+// The connection manager rejoins when the credentials change
+static void cmdWifiSsid(char *arg) {
+  if (*arg) {
+    config.save("wifi", "ssid", arg);
+    Serial.printf("SSID set to: %s\n", arg);
+  } else if (strlen(config.ssid) > 0) {
+    Serial.printf("Current SSID: %s\n", config.ssid);
+  } else {
+    Serial.println("SSID not set");
+  }
+}
+
+static void cmdWifiStatic(char *arg) {
+  if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+    config.save("wifi", "static", strcmp(arg, "on") == 0);
+    Serial.printf("Static IP reuse set to: %s\n", arg);
+  } else if (*arg) {
+    Serial.println("Usage: wifi static [on|off]");
+  } else {
+    Serial.printf("Static IP reuse: %s\n", config.wifi_static ? "on" : "off");
+  }
+}
+
+static void cmdWifiPasswd(char *arg) {
+  if (*arg) {
+    config.save("wifi", "passwd", arg);
+    Serial.printf("Password set to: %s\n", arg);
+  } else if (strlen(config.passwd) > 0) {
+    Serial.printf("Current password: %s\n", config.passwd);
+  } else {
+    Serial.println("Password not set");
+  }
+}
+
+static void cmdDns(char *arg) {
+  char *first = nextToken(arg);
+  char *second = nextToken(arg);
+  IPAddress dns1, dns2;
+  if (!first) {
+    Serial.print("Current DNS Server 1: ");
+    Serial.println(WiFi.dnsIP(0));
+    Serial.print("Current DNS Server 2: ");
+    Serial.println(WiFi.dnsIP(1));
+    Serial.println("Usage: dns [ip1] [ip2]");
+  } else if (second) {
+    if (dns1.fromString(first) && dns2.fromString(second)) {
+      WiFi.config(WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), dns1,
+                  dns2);
+      Serial.print("DNS servers set to: ");
+      Serial.print(dns1);
+      Serial.print(" and ");
+      Serial.println(dns2);
+    } else {
+      Serial.println("Invalid IP addresses");
+    }
+  } else if (dns1.fromString(first)) {
+    WiFi.config(WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), dns1);
+    Serial.print("Primary DNS server set to: ");
+    Serial.println(dns1);
+  } else {
+    Serial.println("Invalid IP address");
+  }
+}
+
+static void cmdServer(char *arg) {
+  if (*arg) {
+    config.save("config", "server", arg);
+    Serial.printf("Server URL set to: %s\n", arg);
+  } else if (strlen(config.server) > 0) {
+    Serial.printf("Current server URL: %s\n", config.server);
+  } else {
+    Serial.println("Server URL not set");
+  }
+}
+
+static void cmdServerDiscover(char *arg) {
+  if (strcmp(arg, "off") == 0) {
+    config.save("config", "domain", "");
+    Serial.println("Server discovery off, server URL kept");
+  } else if (*arg) {
+    if (strlen(arg) >= sizeof(config.domain) || strchr(arg, '/')) {
+      Serial.println("Invalid domain");
+      return;
+    }
+    // The next announcement is adopted and pinned
+    config.save("config", "server", "");
+    config.save("config", "domain", arg);
+    Serial.printf("Server URL cleared, discovering the server for domain: %s\n",
+                  arg);
+  } else if (config.domain[0]) {
+    Serial.printf("Discovering the server for domain: %s\n", config.domain);
+  } else {
+    Serial.println("Server discovery off");
+  }
+}
+
+static void cmdStatus(char *arg) {
+  Status sample = status.read();
+  Serial.printf("Temperature: %.2f °C, Humidity: %.2f%%, Fan Speed: %.2f RPM",
+                sample.temperature, sample.humidity, sample.fan_rpm);
+  if (getFanPower() > 0.0f && fan_pulse_counters[0].stalled())
+    Serial.print(" (stalled)");
+  if (!std::isnan(getFanTargetRpm()))
+    Serial.printf(", Target: %.2f RPM", getFanTargetRpm());
+  Serial.println();
+  // Per-sensor readings when more than one sensor is fitted
+  for (uint8_t i = 0; sample.sensor_count > 1 && i < sample.sensor_count; i++)
+    Serial.printf("  Sensor 0x%02x: %.2f °C, %.2f%%\n", sensorAddress(i),
+                  sample.sensors[i].temperature, sample.sensors[i].humidity);
+  Serial.printf("Fan Power: %.2f%%, Duty: %.2f%%\n", getFanPower() * 100.0f,
+                getFanDuty() * 100.0f);
+  // Per-channel state when more than one fan is fitted
+  for (uint8_t i = 0; sample.fan_count > 1 && i < sample.fan_count; i++)
+    Serial.printf("  Fan %u: %.2f RPM, %.2f%%%s\n", i, sample.fans[i].rpm,
+                  sample.fans[i].power * 100.0f,
+                  sample.fans[i].power > 0.0f && fan_pulse_counters[i].stalled()
+                      ? " (stalled)"
+                      : "");
+}
+
+static void cmdReportHeartbeat(char *arg) {
+  if (*arg) {
+    long interval = atol(arg);
+    if (interval < 100) {
+      Serial.println("Heartbeat must be at least 100 ms");
+    } else {
+      config.save("config", "heartbeat", (uint32_t)interval);
+      Serial.printf("Report heartbeat set to: %ld ms\n", interval);
+    }
+  } else {
+    Serial.printf("Current report heartbeat: %lu ms\n",
+                  (unsigned long)config.report_heartbeat);
+  }
+}
+
+static void cmdReportTransport(char *arg) {
+  static const char *transports[] = {"http", "udp"};
+  for (uint8_t i = TRANSPORT_HTTP; *arg && i <= TRANSPORT_UDP; i++) {
+    if (strcmp(arg, transports[i]) == 0) {
+      config.save("config", "transport", i);
+      Serial.printf("Telemetry transport set to: %s\n", arg);
+      return;
+    }
+  }
+  if (*arg) {
+    Serial.println("Usage: report transport [http|udp]");
     return;
   }
+  uint8_t transport = config.transport <= TRANSPORT_UDP ? config.transport
+                                                        : TRANSPORT_HTTP;
+  Serial.printf("Telemetry transport: %s%s\n", transports[transport],
+                transport == TRANSPORT_UDP && !udpTelemetryActive()
+                    ? " (using HTTP)"
+                    : "");
+}
+
+static void cmdReportDeadband(char *arg) {
+  if (*arg) {
+    float values[3] = {config.deadband_temperature, config.deadband_humidity,
+                       config.deadband_rpm};
+    char *token;
+    for (int i = 0; i < 3 && (token = nextToken(arg)); i++)
+      values[i] = fabsf(atof(token));
+    config.save("config", "db_temp", values[0]);
+    config.save("config", "db_hum", values[1]);
+    config.save("config", "db_rpm", values[2]);
+  }
+  Serial.printf("Report deadband: %.2f °C, %.2f %%, %.2f RPM\n",
+                config.deadband_temperature, config.deadband_humidity,
+                config.deadband_rpm);
+}
 
-  // New message - reset counter
-  last_log_message = message;
-  log_repeat_count = 1;
+static void cmdSensorRate(char *arg) {
+  if (*arg) {
+    long interval = atol(arg);
+    if (interval < SAMPLE_INTERVAL_MIN_MS || interval > SAMPLE_INTERVAL_MAX_MS) {
+      Serial.printf("Sampling period must be %d-%d ms\n",
+                    SAMPLE_INTERVAL_MIN_MS, SAMPLE_INTERVAL_MAX_MS);
+    } else {
+      config.save("config", "sample_ms", (uint32_t)interval);
+      Serial.printf("Sampling period set to: %ld ms\n", interval);
+    }
+  } else {
+    Serial.printf("Current sampling period: %lu ms\n",
+                  (unsigned long)config.sample_interval);
+  }
+}
 
-  // Erase current line using backspaces
-  // Erase "> " prompt (2 chars) + current input
-  int total_chars = 2 + current_input.length();
-  for (int i = 0; i < total_chars; i++) {
-    Serial.print("\b \b");
+static void cmdSensorRepeatability(char *arg) {
+  if (strcmp(arg, "high") == 0 || strcmp(arg, "low") == 0) {
+    config.save("config", "sensor_low", strcmp(arg, "low") == 0);
+    Serial.printf("Sensor repeatability set to: %s\n", arg);
+  } else if (*arg) {
+    Serial.println("Usage: sensor repeatability [high|low]");
+  } else {
+    Serial.printf("Current sensor repeatability: %s\n",
+                  config.sensor_low_repeatability ? "low" : "high");
   }
+}
 
-  // Print the log message
-  Serial.println(message);
+static void cmdFanTach(char *arg) {
+  static const char *tach_modes[] = {"isr", "pcnt", "period"};
+  for (uint8_t mode = 0; *arg && mode < 3; mode++) {
+    if (strcmp(arg, tach_modes[mode]) == 0) {
+      config.save("config", "tach", mode);
+      setFanTachMode((TachMode)mode);
+      Serial.printf("Tachometer mode set to: %s\n", arg);
+      return;
+    }
+  }
+  if (*arg)
+    Serial.println("Usage: fan tach [isr|pcnt|period]");
+  else
+    Serial.printf("Current tachometer mode: %s\n",
+                  tach_modes[fan_pulse_counters[0].getMode()]);
+}
 
-  // Restore prompt and current input
-  Serial.print("> ");
-  Serial.print(current_input);
+static void cmdFanMode(char *arg) {
+  if (strcmp(arg, "open") == 0 || strcmp(arg, "closed") == 0) {
+    config.save("config", "fan_closed", strcmp(arg, "closed") == 0);
+    // The control task switches over on its next tick
+    Serial.printf("Fan control mode set to: %s\n", arg);
+  } else if (*arg) {
+    Serial.println("Usage: fan mode [open|closed]");
+  } else {
+    Serial.printf("Current fan control mode: %s\n",
+                  config.fan_closed_loop ? "closed" : "open");
+    for (uint8_t i = 0; i < fanChannels(); i++) {
+      FanCalibration cal = getFanCalibration(i);
+      if (cal.valid)
+        Serial.printf("Fan %u calibration: %.0f-%.0f RPM\n", i, cal.rpm_min,
+                      cal.rpm_max);
+      else
+        Serial.printf("Fan %u calibration: none (open loop)\n", i);
+    }
+  }
+}
+
+static void cmdFanCalibrate(char *arg) {
+  calibrateFan();
+  Serial.println("Fan calibration scheduled");
+}
+
+static void cmdFanPwm(char *arg) {
+  char *first = nextToken(arg);
+  char *second = nextToken(arg);
+  if (first) {
+    uint32_t freq = atol(first);
+    uint8_t bits = second ? atoi(second) : config.fan_pwm_bits;
+    if (setFanPwm(freq, bits))
+      Serial.printf("Fan PWM set to: %lu Hz, %u bits\n", (unsigned long)freq,
+                    bits);
+    else
+      Serial.println("Unsupported PWM setting, frequency * 2^bits must not "
+                     "exceed 80 MHz");
+  } else {
+    Serial.printf("Current fan PWM: %lu Hz, %u bits\n",
+                  (unsigned long)config.fan_pwm_freq, config.fan_pwm_bits);
+  }
+}
+
+static void cmdFanRamp(char *arg) {
+  if (*arg) {
+    long ramp = atol(arg);
+    if (ramp < 0 || ramp > 60000) {
+      Serial.println("Ramp must be 0-60000 ms");
+      return;
+    }
+    config.save("config", "fan_ramp_ms", (uint32_t)ramp);
+    Serial.printf("Fan ramp set to: %ld ms per full swing\n", ramp);
+  } else {
+    Serial.printf("Current fan ramp: %lu ms per full swing\n",
+                  (unsigned long)config.fan_ramp);
+  }
+}
+
+static void cmdFanChannels(char *arg) {
+  if (*arg) {
+    long count = atol(arg);
+    if (count < 1 || count > FAN_MAX_CHANNELS) {
+      Serial.printf("Fan channels must be 1-%d\n", FAN_MAX_CHANNELS);
+      return;
+    }
+    config.save("config", "fan_channels", (uint8_t)count);
+    Serial.printf("Fan channels set to: %ld, reboot to apply\n", count);
+  } else {
+    Serial.printf("Current fan channels: %u\n", fanChannels());
+  }
+}
+
+static void cmdFan(char *arg) {
+  // "fan <speed>" sets every channel, "fan <channel> <speed>" just one
+  char *first = nextToken(arg);
+  char *second = nextToken(arg);
+  if (second) {
+    long channel = atol(first);
+    if (channel < 0 || channel >= fanChannels()) {
+      Serial.printf("Fan channel must be 0-%u\n", fanChannels() - 1);
+      return;
+    }
+    Serial.printf("Fan %ld power set to: %.2f%%\n", channel,
+                  setFanPower((uint8_t)channel, atof(second)) * 100.0f);
+  } else if (first) {
+    Serial.printf("Fan power set to: %.2f%%\n",
+                  setFanPower(atof(first)) * 100.0f);
+  } else {
+    for (uint8_t i = 0; i < fanChannels(); i++) {
+      float power = getFanPower(i);
+      Serial.print("Current fan power");
+      if (fanChannels() > 1)
+        Serial.printf(" (fan %u)", i);
+      if (std::isnan(power))
+        Serial.println(": (NaN)");
+      else
+        Serial.printf(": %.2f%%\n", power * 100.0f);
+    }
+  }
+}
+
+// Dotted quad into a caller buffer of at least 16 bytes
+static const char *formatIp(IPAddress ip, char *buf) {
+  snprintf(buf, 16, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return buf;
+}
+
+static void cmdDig(char *arg) {
+  if (!*arg) {
+    log(LOG_CONSOLE, "Usage: dig [hostname]");
+    return;
+  }
+  if (!wifiConnected()) {
+    log(LOG_CONSOLE, "Error: WiFi not connected");
+    return;
+  }
+  char buf[16];
+  log(LOG_CONSOLE, "DNS Server 1: %s", formatIp(WiFi.dnsIP(0), buf));
+  log(LOG_CONSOLE, "DNS Server 2: %s", formatIp(WiFi.dnsIP(1), buf));
+  log(LOG_CONSOLE, "Looking up: %s", arg);
+  IPAddress ip;
+  unsigned long started = millis();
+  bool success = WiFi.hostByName(arg, ip);
+  unsigned long elapsed = millis() - started;
+  if (success) {
+    log(LOG_CONSOLE, "IP Address: %s", formatIp(ip, buf));
+    log(LOG_CONSOLE, "Query time: %lu ms", elapsed);
+  } else {
+    log(LOG_CONSOLE, "DNS lookup failed after %lu ms", elapsed);
+    log(LOG_CONSOLE, "Try: wifi status (to check connection)");
+  }
+}
+
+static void cmdPing(char *arg) {
+  if (!*arg) {
+    log(LOG_CONSOLE, "Usage: ping [host]");
+    return;
+  }
+  if (!wifiConnected()) {
+    log(LOG_CONSOLE, "Error: WiFi not connected");
+    return;
+  }
+  IPAddress ip;
+  char buf[16];
+  // Try to parse as IP address first
+  if (ip.fromString(arg)) {
+    log(LOG_CONSOLE, "Pinging %s...", arg);
+  } else {
+    // It's a hostname, resolve it first
+    log(LOG_CONSOLE, "Resolving %s...", arg);
+    if (!WiFi.hostByName(arg, ip)) {
+      log(LOG_CONSOLE, "DNS lookup failed");
+      return;
+    }
+    log(LOG_CONSOLE, "Resolved to: %s", formatIp(ip, buf));
+  }
+  if (Ping.ping(ip, 4))
+    log(LOG_CONSOLE, "Reply from %s: time=%.2f ms", formatIp(ip, buf),
+        Ping.averageTime());
+  else
+    log(LOG_CONSOLE, "Ping failed: No response");
+}
+
+static void cmdPower(char *arg) {
+  if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+    config.save("config", "power_save", strcmp(arg, "on") == 0);
+    // Applied by the LED task, which may be idle
+    ledSignal(LED_EVENT_REFRESH);
+    Serial.printf("Low-power mode set to: %s\n", arg);
+  } else if (*arg) {
+    Serial.println("Usage: power [on|off]");
+  } else {
+    Serial.printf("Low-power mode: %s%s\n", config.power_save ? "on" : "off",
+                  isLowPower() ? " (active)" : "");
+  }
+}
+
+static void cmdRelay(char *arg) {
+  static const char *relay_modes[] = {"off", "forward", "leaf"};
+  for (uint8_t mode = RELAY_OFF; *arg && mode <= RELAY_LEAF; mode++) {
+    if (strcmp(arg, relay_modes[mode]) == 0) {
+      config.save("config", "relay", mode);
+      Serial.printf("Relay mode set to: %s, reboot to apply\n", arg);
+      return;
+    }
+  }
+  if (*arg) {
+    Serial.println("Usage: relay [off|forward|leaf]");
+    return;
+  }
+  Serial.printf("Relay mode: %s", relay_modes[relayMode()]);
+  if (relayMode() == RELAY_LEAF)
+    Serial.print(relayLinked() ? " (linked)" : " (no relay)");
+  if (config.relay_mode != relayMode() && config.relay_mode <= RELAY_LEAF)
+    Serial.printf(", %s after reboot", relay_modes[config.relay_mode]);
+  Serial.println();
+}
+
+static void cmdLogDump(char *arg) {
+  for (size_t i = 0; i < history.size(); i++)
+    printRecord(history.peek(i), 1);
+}
+
+static void cmdLogLevel(char *arg) {
+  for (uint8_t level = LOG_DEBUG; *arg && level <= LOG_ERROR; level++) {
+    if (strcmp(arg, logLevelName((LogLevel)level)) == 0) {
+      config.save("config", "log_level", level);
+      Serial.printf("Log level set to: %s\n", arg);
+      return;
+    }
+  }
+  if (*arg)
+    Serial.println("Usage: log level [debug|info|warn|error]");
+  else
+    Serial.printf("Current log level: %s\n",
+                  logLevelName((LogLevel)config.log_level));
+}
+
+static void cmdPerf(char *arg) { printPerf(); }
+
+static void cmdPerfTelemetry(char *arg) {
+  if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+    config.save("config", "perf_tx", strcmp(arg, "on") == 0);
+    Serial.printf("Perf telemetry set to: %s\n", arg);
+  } else if (*arg) {
+    Serial.println("Usage: perf telemetry [on|off]");
+  } else {
+    Serial.printf("Perf telemetry: %s\n", config.perf_telemetry ? "on" : "off");
+  }
+}
+
+static void cmdOta(char *arg) {
+  if (*arg) {
+    if (startOta(arg))
+      Serial.printf("OTA update started from: %s\n", arg);
+    else
+      Serial.println("OTA update already running");
+  } else {
+    Serial.printf("Running partition: %s%s\n",
+                  esp_ota_get_running_partition()->label,
+                  otaPending() ? " (on probation)" : "");
+    Serial.println("Usage: ota [url]");
+  }
+}
+
+static void cmdReset(char *arg) {
+  Serial.println("Wiping all preferences...");
+  config.wipe();
+  Serial.println("Rebooting...");
+  delay(500);
+  ESP.restart();
+}
+
+// Matched in order, the first entry whose name is a whole-word prefix of the
+// line wins, so longer names go before shorter ones
+static constexpr Command commands[] = {
+    {"help", "", "Show this help message", cmdHelp, false},
+    {"wifi status", "", "Show WiFi connection status", cmdWifiStatus, false},
+    {"wifi ssid", "[value]", "Get/set WiFi SSID", cmdWifiSsid, false},
+    {"wifi passwd", "[value]", "Get/set WiFi password", cmdWifiPasswd, false},
+    {"wifi static", "[on|off]", "Reuse the last IP lease on reconnect",
+     cmdWifiStatic, false},
+    {"dns", "[ip1] [ip2]", "Set custom DNS servers (e.g., 8.8.8.8 8.8.4.4)",
+     cmdDns, false},
+    {"server discover", "[domain|off]",
+     "Get/set domain to find the server for on the LAN", cmdServerDiscover,
+     false},
+    {"server", "[url]", "Get/set server URL", cmdServer, false},
+    {"status", "", "Show sensor and fan status", cmdStatus, false},
+    {"report heartbeat", "[ms]", "Get/set max time between reports",
+     cmdReportHeartbeat, false},
+    {"report deadband", "[temp] [hum] [rpm]", "Get/set change thresholds",
+     cmdReportDeadband, false},
+    {"report transport", "[http|udp]", "Get/set telemetry transport",
+     cmdReportTransport, false},
+    {"sensor rate", "[ms]", "Get/set sensor sampling period", cmdSensorRate,
+     false},
+    {"sensor repeatability", "[high|low]", "Get/set SHT3x precision",
+     cmdSensorRepeatability, false},
+    {"fan tach", "[isr|pcnt|period]", "Get/set tachometer mode", cmdFanTach,
+     false},
+    {"fan mode", "[open|closed]", "Get/set fan control mode", cmdFanMode,
+     false},
+    {"fan calibrate", "", "Measure the fan RPM range", cmdFanCalibrate, false},
+    {"fan pwm", "[freq] [bits]", "Get/set fan PWM frequency and resolution",
+     cmdFanPwm, false},
+    {"fan ramp", "[ms]", "Get/set open loop fade time, 0 steps instantly",
+     cmdFanRamp, false},
+    {"fan channels", "[n]", "Get/set fitted fan channels", cmdFanChannels,
+     false},
+    {"fan", "[channel] [speed]", "Get/set fan speed (0.0-1.0)", cmdFan, false},
+    {"dig", "[hostname]", "Perform DNS lookup", cmdDig, true},
+    {"ping", "[host]", "Ping an IP address or hostname", cmdPing, true},
+    {"power", "[on|off]", "Get/set low-power mode while idle", cmdPower, false},
+    {"relay", "[off|forward|leaf]", "Get/set ESP-NOW relay role", cmdRelay,
+     false},
+    {"perf telemetry", "[on|off]", "Send device stats with telemetry",
+     cmdPerfTelemetry, false},
+    {"perf", "", "Show task, heap and latency stats", cmdPerf, false},
+    {"log dump", "", "Replay recent log messages", cmdLogDump, false},
+    {"log level", "[debug|info|warn|error]", "Get/set minimum log level",
+     cmdLogLevel, false},
+    {"ota", "[url]", "Update firmware from an http:// URL (.bin or .bin.gz)",
+     cmdOta, false},
+    {"reset", "", "Wipe all settings and reboot", cmdReset, false},
+};
+
+static void cmdHelp(char *arg) {
+  Serial.println("Available commands:");
+  for (const Command &command : commands) {
+    int width = Serial.printf("  %s%s%s", command.name,
+                              *command.usage ? " " : "", command.usage);
+    Serial.printf("%*s - %s\n", width < 22 ? 22 - width : 0, "",
+                  command.help);
+  }
+}
+
+static const Command *findCommand(char *input, char *&arg) {
+  for (const Command &command : commands) {
+    size_t length = strlen(command.name);
+    if (strncmp(input, command.name, length) == 0 &&
+        (input[length] == '\0' || input[length] == ' ')) {
+      arg = input + length;
+      while (*arg == ' ')
+        arg++;
+      return &command;
+    }
+  }
+  return nullptr;
+}
+
+// Runs blocking commands so the console keeps reading input
+static void consoleWorkerTask(void *parameter) {
+  ConsoleJob job;
+  while (true) {
+    if (xQueueReceive(jobs, &job, portMAX_DELAY) != pdTRUE)
+      continue;
+    job.handler(job.arg);
+    job_busy = false;
+  }
+}
+
+static void execute(char *input) {
+  // Trim trailing spaces, leading ones never reach the buffer
+  size_t length = strlen(input);
+  while (length > 0 && input[length - 1] == ' ')
+    input[--length] = '\0';
+  char *arg;
+  const Command *command = findCommand(input, arg);
+  if (!command) {
+    Serial.printf("Unknown command: %s\n", input);
+    Serial.println("Type 'help' for available commands");
+    return;
+  }
+  if (!command->async) {
+    command->handler(arg);
+    return;
+  }
+  if (job_busy.exchange(true)) {
+    Serial.println("Busy, previous command still running");
+    return;
+  }
+  ConsoleJob job;
+  job.handler = command->handler;
+  strlcpy(job.arg, arg, sizeof(job.arg));
+  xQueueSend(jobs, &job, 0);
 }
 
 void consoleTask(void *parameter) {
+  jobs = xQueueCreate(1, sizeof(ConsoleJob));
+  xTaskCreatePinnedToCore(consoleWorkerTask,    // Task function
+                          "ConsoleJob",         // Task name
+                          STACK_CONSOLE_JOB,    // Stack size (bytes)
+                          NULL,                 // Parameter
+                          PRIORITY_CONSOLE_JOB, // Priority
+                          NULL,                 // Task handle
+                          CORE_NETWORK          // Core
+  );
   Serial.println("\n=== Smart AC Console ===");
   Serial.println("Type 'help' for available commands");
   Serial.print("> ");
   while (true) {
-    if (Serial.available()) {
-      char c = Serial.read();
-      if (c == '\n' || c == '\r') {
-        if (current_input.length() > 0) {
-          Serial.println();
-          current_input.trim();
-          // Parse and execute command
-          if (current_input == "help") {
-            Serial.println(
-                "Available commands:\n"
-                "  help                 - Show this help message\n"
-                "  wifi status          - Show WiFi connection status\n"
-                "  wifi ssid [value]    - Get/set WiFi SSID\n"
-                "  wifi passwd [value]  - Get/set WiFi password\n"
-                "  dns [ip1] [ip2]      - Set custom DNS servers (e.g., 8.8.8.8 8.8.4.4)\n"
-                "  server [url]         - Get/set server URL\n"
-                "  status               - Show sensor and fan status\n"
-                "  fan [speed]          - Get/set fan speed (0.0-1.0)\n"
-                "  dig [hostname]       - Perform DNS lookup\n"
-                "  ping [host]          - Ping an IP address or hostname\n"
-                "  reset                - Wipe all settings and reboot");
-          } else if (current_input == "wifi status") {
-            Serial.print("WiFi Status: ");
-            if (WiFi.status() == WL_CONNECTED) {
-              Serial.println("Connected");
-              Serial.print("SSID: ");
-              Serial.println(WiFi.SSID());
-              Serial.print("IP Address: ");
-              Serial.println(WiFi.localIP());
-              Serial.print("Signal Strength: ");
-              Serial.print(WiFi.RSSI());
-              Serial.println(" dBm");
-            } else {
-              Serial.println("Disconnected");
-            }
-            Serial.print("MAC Address: ");
-            Serial.println(WiFi.macAddress());
-          } else if (current_input.startsWith("wifi ssid")) {
-            String arg = current_input.substring(9);
-            arg.trim();
-            if (arg.length() > 0) {
-              preferences.begin("wifi", false);
-              preferences.putString("ssid", arg);
-              preferences.end();
-              if (WiFi.status() == WL_CONNECTED) {
-                WiFi.disconnect();
-              }
-              Serial.print("SSID set to: ");
-              Serial.println(arg);
-            } else {
-              preferences.begin("wifi", true);
-              String ssid = preferences.getString("ssid", "");
-              preferences.end();
-              if (ssid.length() > 0) {
-                Serial.print("Current SSID: ");
-                Serial.println(ssid);
-              } else {
-                Serial.println("SSID not set");
-              }
-            }
-          } else if (current_input.startsWith("wifi passwd")) {
-            String arg = current_input.substring(11);
-            arg.trim();
-            if (arg.length() > 0) {
-              preferences.begin("wifi", false);
-              preferences.putString("passwd", arg);
-              preferences.end();
-              if (WiFi.status() == WL_CONNECTED) {
-                WiFi.disconnect();
-              }
-              Serial.print("Password set to: ");
-              Serial.println(arg);
-            } else {
-              preferences.begin("wifi", true);
-              String passwd = preferences.getString("passwd", "");
-              preferences.end();
-              if (passwd.length() > 0) {
-                Serial.print("Current password: ");
-                Serial.println(passwd);
-              } else {
-                Serial.println("Password not set");
-              }
-            }
-          } else if (current_input.startsWith("dns")) {
-            String arg = current_input.substring(3);
-            arg.trim();
-            if (arg.length() > 0) {
-              // Parse two IP addresses
-              int spacePos = arg.indexOf(' ');
-              IPAddress dns1, dns2;
-              if (spacePos > 0) {
-                String ip1Str = arg.substring(0, spacePos);
-                String ip2Str = arg.substring(spacePos + 1);
-                if (dns1.fromString(ip1Str) && dns2.fromString(ip2Str)) {
-                  WiFi.config(WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), dns1, dns2);
-                  Serial.print("DNS servers set to: ");
-                  Serial.print(dns1);
-                  Serial.print(" and ");
-                  Serial.println(dns2);
-                } else {
-                  Serial.println("Invalid IP addresses");
-                }
-              } else if (dns1.fromString(arg)) {
-                WiFi.config(WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), dns1);
-                Serial.print("Primary DNS server set to: ");
-                Serial.println(dns1);
-              } else {
-                Serial.println("Invalid IP address");
-              }
-            } else {
-              Serial.print("Current DNS Server 1: ");
-              Serial.println(WiFi.dnsIP(0));
-              Serial.print("Current DNS Server 2: ");
-              Serial.println(WiFi.dnsIP(1));
-              Serial.println("Usage: dns [ip1] [ip2]");
-            }
-          } else if (current_input.startsWith("server")) {
-            String arg = current_input.substring(6);
-            arg.trim();
-            if (arg.length() > 0) {
-              preferences.begin("config", false);
-              preferences.putString("server", arg);
-              preferences.end();
-              Serial.print("Server URL set to: ");
-              Serial.println(arg);
-            } else {
-              preferences.begin("config", true);
-              String server = preferences.getString("server", "");
-              preferences.end();
-              if (server.length() > 0) {
-                Serial.print("Current server URL: ");
-                Serial.println(server);
-              } else {
-                Serial.println("Server URL not set");
-              }
-            }
-          } else if (current_input == "status") {
-            status.update();
-            Serial.print("Temperature: ");
-            Serial.print(status.temperature);
-            Serial.print(" °C, Humidity: ");
-            Serial.print(status.humidity);
-            Serial.print("%, Fan Speed: ");
-            Serial.print(status.fan_rpm);
-            Serial.println(" RPM");
-            Serial.print("Fan Power: ");
-            Serial.print(getFanPower() * 100.0f);
-            Serial.println("%");
-          } else if (current_input.startsWith("fan")) {
-            String arg = current_input.substring(3);
-            arg.trim();
-            if (arg.length() > 0) {
-              float power = arg.toFloat();
-              Serial.print("Fan power set to: ");
-              Serial.print(setFanPower(power) * 100.0f);
-              Serial.println("%");
-            } else {
-              Serial.print("Current fan power: ");
-              auto power = getFanPower();
-              if (std::isnan(power)) {
-                Serial.println("(NaN)");
-              } else {
-                Serial.print(power * 100.0f);
-                Serial.println("%");
-              }
-            }
-          } else if (current_input.startsWith("dig")) {
-            String arg = current_input.substring(3);
-            arg.trim();
-            if (arg.length() > 0) {
-              if (WiFi.status() != WL_CONNECTED) {
-                Serial.println("Error: WiFi not connected");
-              } else {
-                // Display current DNS servers
-                Serial.print("DNS Server 1: ");
-                Serial.println(WiFi.dnsIP(0));
-                Serial.print("DNS Server 2: ");
-                Serial.println(WiFi.dnsIP(1));
-                Serial.flush();
-                
-                IPAddress ip;
-                Serial.print("Looking up: ");
-                Serial.println(arg);
-                Serial.flush();
-                
-                // Try DNS lookup
-                unsigned long startTime = millis();
-                bool success = WiFi.hostByName(arg.c_str(), ip);
-                unsigned long elapsed = millis() - startTime;
-                
-                Serial.flush();
-                if (success) {
-                  Serial.print("IP Address: ");
-                  Serial.println(ip);
-                  Serial.print("Query time: ");
-                  Serial.print(elapsed);
-                  Serial.println(" ms");
-                } else {
-                  Serial.print("DNS lookup failed after ");
-                  Serial.print(elapsed);
-                  Serial.println(" ms");
-                  Serial.println("Try: wifi status (to check connection)");
-                }
-                Serial.flush();
-              }
-            } else {
-              Serial.println("Usage: dig [hostname]");
-            }
-          } else if (current_input.startsWith("ping")) {
-            String arg = current_input.substring(4);
-            arg.trim();
-            if (arg.length() > 0) {
-              if (WiFi.status() != WL_CONNECTED) {
-                Serial.println("Error: WiFi not connected");
-              } else {
-                IPAddress ip;
-                // Try to parse as IP address first
-                if (ip.fromString(arg)) {
-                  Serial.print("Pinging ");
-                  Serial.print(arg);
-                  Serial.println("...");
-                } else {
-                  // It's a hostname, resolve it first
-                  Serial.print("Resolving ");
-                  Serial.print(arg);
-                  Serial.println("...");
-                  if (WiFi.hostByName(arg.c_str(), ip)) {
-                    Serial.print("Resolved to: ");
-                    Serial.println(ip);
-                  } else {
-                    Serial.println("DNS lookup failed");
-                    Serial.print("> ");
-                    continue;
-                  }
-                }
-                // Perform ping
-                if (Ping.ping(ip, 4)) {
-                  Serial.print("Reply from ");
-                  Serial.print(ip);
-                  Serial.print(": time=");
-                  Serial.print(Ping.averageTime());
-                  Serial.println(" ms");
-                } else {
-                  Serial.println("Ping failed: No response");
-                }
-              }
-            } else {
-              Serial.println("Usage: ping [host]");
-            }
-          } else if (current_input == "reset") {
-            Serial.println("Wiping all preferences...");
-            preferences.begin("wifi", false);
-            preferences.clear();
-            preferences.end();
-            preferences.begin("config", false);
-            preferences.clear();
-            preferences.end();
-            Serial.println("Rebooting...");
-            delay(500);
-            ESP.restart();
-          } else {
-            Serial.print("Unknown command: ");
-            Serial.println(current_input);
-            Serial.println("Type 'help' for available commands");
-          }
-          current_input = "";
-          Serial.print("> ");
-        }
-      } else if (c == 8 || c == 127) { // Backspace
-        if (current_input.length() > 0) {
-          current_input.remove(current_input.length() - 1);
-          Serial.print("\b \b");
-        }
-      } else if (c >= 32 && c <= 126) { // Printable characters
-        current_input += c;
-        Serial.print(c);
+    if (!Serial.available()) {
+      // Sleeps until a log record arrives or it is time to poll input
+      drainLog(pdMS_TO_TICKS(10));
+      continue;
+    }
+    char c = Serial.read();
+    if (c == '\n' || c == '\r') {
+      if (line_length > 0) {
+        Serial.println();
+        // Run on a copy, the prompt is empty while the command prints
+        char input[CONSOLE_LINE_MAX];
+        memcpy(input, line, line_length + 1);
+        line_length = 0;
+        line[0] = '\0';
+        execute(input);
+        Serial.print("> ");
       }
-    } else {
-      vTaskDelay(pdMS_TO_TICKS(10));
+    } else if (c == 8 || c == 127) { // Backspace
+      if (line_length > 0) {
+        line[--line_length] = '\0';
+        Serial.print("\b \b");
+      }
+    } else if (c >= 32 && c <= 126) { // Printable characters
+      // Drop leading spaces and anything past the end of the buffer
+      if ((c == ' ' && line_length == 0) || line_length + 1 >= sizeof(line))
+        continue;
+      line[line_length++] = c;
+      line[line_length] = '\0';
+      Serial.print(c);
     }
   }
 }
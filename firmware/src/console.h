@@ -2,8 +2,8 @@
 
 #include <Arduino.h>
 
-// Log function that preserves the interactive prompt
-void log(const String &message);
+// Longest console input line, including the terminator
+#define CONSOLE_LINE_MAX 128
 
-// Console task function
+// Console task function, also prints queued log records
 void consoleTask(void *parameter);
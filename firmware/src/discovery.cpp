@@ -0,0 +1,48 @@
+#include "discovery.h"
+#include "connection.h"
+#include "global.h"
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+
+static WiFiUDP udp;
+static bool listening = false;
+
+void pollDiscovery(const Config &local) {
+  if (!local.domain[0] || !wifiConnected()) {
+    if (listening)
+      udp.stop();
+    listening = false;
+    return;
+  }
+  if (!listening)
+    listening = udp.begin(DISCOVERY_PORT);
+  if (!listening || udp.parsePacket() <= 0)
+    return;
+  char message[32];
+  int length = udp.read(message, sizeof(message) - 1);
+  if (length <= 0)
+    return;
+  message[length] = '\0';
+  unsigned version, port;
+  if (sscanf(message, "SMARTAC %u %u", &version, &port) != 2 ||
+      version != DISCOVERY_VERSION || port == 0 || port > 65535)
+    return;
+  char url[sizeof(local.server)];
+  snprintf(url, sizeof(url), "http://%s:%u/unit/%s",
+           udp.remoteIP().toString().c_str(), port, local.domain);
+  if (strcmp(url, local.server) == 0)
+    return;
+  if (local.server[0]) {
+    // Pinned, any LAN host could announce itself. Logged once per sender.
+    static IPAddress ignored;
+    if (udp.remoteIP() != ignored)
+      log(LOG_WARN,
+          "Ignoring server announced at %s, rerun server discover to switch",
+          udp.remoteIP().toString().c_str());
+    ignored = udp.remoteIP();
+    return;
+  }
+  config.save("config", "server", url);
+  log(LOG_INFO, "Discovered server: %s", url);
+}
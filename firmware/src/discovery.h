@@ -0,0 +1,15 @@
+#pragma once
+
+// Server discovery. The server broadcasts "SMARTAC <version> <port>" to this
+// UDP port, a unit with a discovery domain set and no server URL points it at
+// http://<sender>:<port>/unit/<domain>. The first server found is pinned,
+// announcements from anywhere else are ignored until discovery is rerun.
+#define DISCOVERY_PORT 3001
+#define DISCOVERY_VERSION 1
+
+struct Config;
+
+// Check for an announcement without blocking, saves the server URL to config
+// while it is empty. No-op while the discovery domain is empty or WiFi is
+// down.
+void pollDiscovery(const Config &local);
@@ -0,0 +1,122 @@
+#include "fallback.h"
+#include "global.h"
+#include "logger.h"
+
+#include <cmath>
+
+struct FallbackCurve {
+  uint16_t revision = 0;
+  uint8_t count = 0;
+  float humidity_threshold = NAN;
+  float humidity_power = 0.0f;
+  float temperature[FALLBACK_MAX_POINTS];
+  float power[FALLBACK_MAX_POINTS];
+};
+
+static FallbackCurve curve;
+static portMUX_TYPE curve_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int16_t readInt16(const uint8_t *data) {
+  int16_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static bool parseCurve(const uint8_t *data, size_t length,
+                       FallbackCurve &parsed) {
+  if (length < FALLBACK_HEADER_SIZE)
+    return false;
+  memcpy(&parsed.revision, data, sizeof(parsed.revision));
+  parsed.count = data[2];
+  if (parsed.revision == 0) {
+    parsed.count = 0;
+    return true;
+  }
+  if (parsed.count == 0 || parsed.count > FALLBACK_MAX_POINTS ||
+      length < FALLBACK_HEADER_SIZE + parsed.count * FALLBACK_POINT_SIZE)
+    return false;
+  int16_t threshold = readInt16(data + 4);
+  parsed.humidity_threshold = threshold == FRAME_NAN ? NAN : threshold * 0.01f;
+  parsed.humidity_power = readInt16(data + 6) * 0.0001f;
+  const uint8_t *point = data + FALLBACK_HEADER_SIZE;
+  for (uint8_t i = 0; i < parsed.count; i++, point += FALLBACK_POINT_SIZE) {
+    parsed.temperature[i] = readInt16(point) * 0.01f;
+    parsed.power[i] = constrain(readInt16(point + 2) * 0.0001f, 0.0f, 1.0f);
+    // Interpolation needs ascending temperatures
+    if (i > 0 && parsed.temperature[i] <= parsed.temperature[i - 1])
+      return false;
+  }
+  return true;
+}
+
+void loadFallbackCurve() {
+  uint8_t data[FALLBACK_HEADER_SIZE + FALLBACK_MAX_POINTS * FALLBACK_POINT_SIZE];
+  Preferences preferences;
+  preferences.begin("curve", true);
+  size_t length = preferences.getBytesLength("curve");
+  if (length > 0 && length <= sizeof(data))
+    length = preferences.getBytes("curve", data, sizeof(data));
+  else
+    length = 0;
+  preferences.end();
+  FallbackCurve parsed;
+  if (length == 0 || !parseCurve(data, length, parsed))
+    return;
+  portENTER_CRITICAL(&curve_lock);
+  curve = parsed;
+  portEXIT_CRITICAL(&curve_lock);
+  log(LOG_INFO, "Fallback curve revision %u loaded", parsed.revision);
+}
+
+bool applyFallbackCurve(const uint8_t *data, size_t length) {
+  FallbackCurve parsed;
+  if (!parseCurve(data, length, parsed))
+    return false;
+  if (parsed.revision == fallbackRevision())
+    return true;
+  portENTER_CRITICAL(&curve_lock);
+  curve = parsed;
+  portEXIT_CRITICAL(&curve_lock);
+  // Keep the raw bytes, they are parsed again on boot
+  Preferences preferences;
+  preferences.begin("curve", false);
+  if (parsed.revision == 0)
+    preferences.remove("curve");
+  else
+    preferences.putBytes("curve", data,
+                         FALLBACK_HEADER_SIZE +
+                             parsed.count * FALLBACK_POINT_SIZE);
+  preferences.end();
+  log(LOG_INFO, "Fallback curve revision %u saved", parsed.revision);
+  return true;
+}
+
+uint16_t fallbackRevision() { return curve.revision; }
+
+float fallbackPower(const Status &status) {
+  FallbackCurve local;
+  portENTER_CRITICAL(&curve_lock);
+  local = curve;
+  portEXIT_CRITICAL(&curve_lock);
+  if (local.count == 0 || std::isnan(status.temperature))
+    return NAN;
+  // Piecewise linear in temperature, flat beyond the end points
+  float power = local.power[local.count - 1];
+  if (status.temperature <= local.temperature[0]) {
+    power = local.power[0];
+  } else {
+    for (uint8_t i = 1; i < local.count; i++) {
+      if (status.temperature < local.temperature[i]) {
+        float t = (status.temperature - local.temperature[i - 1]) /
+                  (local.temperature[i] - local.temperature[i - 1]);
+        power = local.power[i - 1] + t * (local.power[i] - local.power[i - 1]);
+        break;
+      }
+    }
+  }
+  // Ventilate humid air regardless of temperature
+  if (!std::isnan(status.humidity) && !std::isnan(local.humidity_threshold) &&
+      status.humidity >= local.humidity_threshold)
+    power = max(power, local.humidity_power);
+  return power;
+}
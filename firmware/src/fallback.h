@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Status;
+
+// Local control curve, pushed by the server and cached in NVS so the unit
+// keeps adapting the fan to its own readings while the server is
+// unreachable.
+//
+// Wire format, appended to the fan power reply when the unit reports a
+// different revision (all integers little-endian):
+//
+//   uint16_t revision, 0 clears the curve
+//   uint8_t  point count (1..FALLBACK_MAX_POINTS)
+//   uint8_t  reserved
+//   int16_t  humidity threshold, 0.01 %
+//   int16_t  minimum power above the threshold, 0.0001
+//   per point, ascending temperature:
+//     int16_t temperature, 0.01 °C
+//     int16_t power, 0.0001
+#define FALLBACK_MAX_POINTS 8
+#define FALLBACK_HEADER_SIZE 8
+#define FALLBACK_POINT_SIZE 4
+
+// Load the cached curve from NVS, call once at boot
+void loadFallbackCurve();
+
+// Parse, apply and persist a curve received from the server, returns false
+// if malformed
+bool applyFallbackCurve(const uint8_t *data, size_t length);
+
+// Revision of the cached curve, 0 if none
+uint16_t fallbackRevision();
+
+// Fan power for the sample from the cached curve, NaN if there is no curve
+// or the sample has no temperature
+float fallbackPower(const Status &status);
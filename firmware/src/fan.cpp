@@ -0,0 +1,281 @@
+#include "fan.h"
+#include "global.h"
+#include "led.h"
+#include "logger.h"
+
+#include <cmath>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const uint8_t pwm_pins[] = FAN_PWM_PINS;
+static const uint8_t tach_pins[] = FAN_TCH_PINS;
+static_assert(sizeof(pwm_pins) == FAN_MAX_CHANNELS &&
+                  sizeof(tach_pins) == FAN_MAX_CHANNELS,
+              "One PWM and one tach pin per fan channel");
+
+// Per-channel control state
+struct FanChannel {
+  // Setpoint from server or console, NaN if not controlled
+  volatile float power = 0.0f;
+  volatile float target_rpm = NAN;
+  FanCalibration calibration;
+  FanPwm pwm;
+  // PID state, owned by the control task
+  float integral = 0.0f;
+  float last_rpm = 0.0f;
+  float duty = 0.0f;
+};
+
+static FanChannel channels[FAN_MAX_CHANNELS];
+static uint8_t channel_count = 1;
+static volatile bool calibration_requested = true;
+// PWM reconfiguration requested from the console, applied by the control
+// task which is the only one writing the outputs
+static volatile bool pwm_requested = false;
+static uint32_t requested_freq = FAN_PWM_FREQ;
+static uint8_t requested_bits = FAN_PWM_BITS;
+static portMUX_TYPE pwm_lock = portMUX_INITIALIZER_UNLOCKED;
+// Tachometer mode change requested from the console, also left to the
+// control task so the counters are not rebuilt under a running tick
+static volatile bool tach_requested = false;
+static volatile uint8_t requested_tach = TACH_ISR;
+static portMUX_TYPE calibration_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline float clamp(float v, float lo, float hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static void writeDuty(uint8_t channel, float duty) {
+  channels[channel].pwm.write(duty);
+}
+
+// Open loop ramp towards duty at config.fan_ramp per full scale, one tick's
+// share at a time as a hardware fade segment. A new setpoint or a reversal
+// takes over from wherever the last segment ended. Returns the duty headed
+// for. Control task only.
+static float rampDuty(uint8_t channel, float duty) {
+  FanPwm &pwm = channels[channel].pwm;
+  float current = pwm.read();
+  if (duty == current || pwm.fading())
+    return current;
+  if (config.fan_ramp == 0) {
+    pwm.write(duty);
+    return duty;
+  }
+  float step = 1000.0f / FAN_CONTROL_HZ / config.fan_ramp;
+  float next = clamp(duty, current - step, current + step);
+  pwm.fade(next, FAN_FADE_SEGMENT_MS);
+  return next;
+}
+
+static bool beginPwm(uint8_t channel, uint32_t freq, uint8_t bits) {
+  return channels[channel].pwm.begin(pwm_pins[channel], freq, bits,
+                                     (ledc_channel_t)channel);
+}
+
+void beginFan() {
+  channel_count = constrain(config.fan_channels, 1, FAN_MAX_CHANNELS);
+  for (uint8_t i = 0; i < channel_count; i++) {
+    if (!beginPwm(i, config.fan_pwm_freq, config.fan_pwm_bits)) {
+      log(LOG_WARN, "Invalid fan PWM setting, using defaults");
+      beginPwm(i, FAN_PWM_FREQ, FAN_PWM_BITS);
+    }
+    writeDuty(i, 0.0f);
+  }
+}
+
+uint8_t fanChannels() { return channel_count; }
+
+bool setFanPwm(uint32_t freq, uint8_t bits) {
+  if (!FanPwm::supported(freq, bits))
+    return false;
+  portENTER_CRITICAL(&pwm_lock);
+  requested_freq = freq;
+  requested_bits = bits;
+  pwm_requested = true;
+  portEXIT_CRITICAL(&pwm_lock);
+  config.save("config", "pwm_freq", freq);
+  config.save("config", "pwm_bits", bits);
+  return true;
+}
+
+// Control task side of setFanPwm(), keeps every channel's duty
+static void applyPwm() {
+  portENTER_CRITICAL(&pwm_lock);
+  uint32_t freq = requested_freq;
+  uint8_t bits = requested_bits;
+  pwm_requested = false;
+  portEXIT_CRITICAL(&pwm_lock);
+  for (uint8_t i = 0; i < channel_count; i++) {
+    float duty = channels[i].pwm.read();
+    if (!beginPwm(i, freq, bits)) {
+      log(LOG_WARN, "Fan PWM %lu Hz / %u bits rejected, using defaults",
+          (unsigned long)freq, bits);
+      beginPwm(i, FAN_PWM_FREQ, FAN_PWM_BITS);
+    }
+    writeDuty(i, duty);
+  }
+}
+
+void beginFanTach(TachMode mode) {
+  for (uint8_t i = 0; i < channel_count; i++)
+    fan_pulse_counters[i].begin(tach_pins[i], mode, (pcnt_unit_t)i);
+}
+
+void setFanTachMode(TachMode mode) {
+  requested_tach = mode;
+  tach_requested = true;
+}
+
+float setFanPower(uint8_t channel, float power) {
+  if (channel >= channel_count)
+    return NAN;
+  FanChannel &fan = channels[channel];
+  float previous = fan.power;
+  if (isnan(power)) {
+    fan.power = power;
+    power = 0.0f;
+  } else {
+    power = clamp(power, 0.0f, 1.0f);
+    fan.power = power;
+  }
+  // The LED follows channel 0
+  if (channel == 0 && (isnan(previous) != isnan(fan.power) ||
+                       (!isnan(fan.power) && previous != fan.power)))
+    ledSignal(LED_EVENT_FAN_POWER, fan.power);
+  // Only published here, the control task picks it up on its next tick
+  return power;
+}
+
+float setFanPower(float power) {
+  float applied = power;
+  for (uint8_t i = 0; i < channel_count; i++)
+    applied = setFanPower(i, power);
+  return applied;
+}
+
+float getFanPower(uint8_t channel) {
+  return channel < channel_count ? channels[channel].power : NAN;
+}
+
+float getFanDuty(uint8_t channel) {
+  return channel < channel_count ? channels[channel].pwm.instant() : NAN;
+}
+
+float getFanTargetRpm(uint8_t channel) {
+  return channel < channel_count ? channels[channel].target_rpm : NAN;
+}
+
+FanCalibration getFanCalibration(uint8_t channel) {
+  FanCalibration result;
+  if (channel >= channel_count)
+    return result;
+  portENTER_CRITICAL(&calibration_lock);
+  result = channels[channel].calibration;
+  portEXIT_CRITICAL(&calibration_lock);
+  return result;
+}
+
+void calibrateFan() { calibration_requested = true; }
+
+// Measure the RPM range at minimum and full duty, all channels at once
+static void calibrate(FanCalibration *results) {
+  log(LOG_INFO, "Calibrating fans...");
+  for (uint8_t i = 0; i < channel_count; i++)
+    writeDuty(i, 1.0f);
+  vTaskDelay(pdMS_TO_TICKS(FAN_CALIBRATION_MS));
+  for (uint8_t i = 0; i < channel_count; i++) {
+    results[i].rpm_max = fan_pulse_counters[i].rpm();
+    writeDuty(i, FAN_MIN_DUTY);
+  }
+  vTaskDelay(pdMS_TO_TICKS(FAN_CALIBRATION_MS));
+  for (uint8_t i = 0; i < channel_count; i++) {
+    FanCalibration &result = results[i];
+    result.rpm_min = fan_pulse_counters[i].rpm();
+    result.valid = result.rpm_max >= FAN_MIN_CALIBRATED_RPM &&
+                   result.rpm_min < result.rpm_max;
+    if (result.valid)
+      log(LOG_INFO, "Fan %u calibrated: %.0f-%.0f RPM", i, result.rpm_min,
+          result.rpm_max);
+    else
+      log(LOG_WARN, "Fan %u calibration failed, running open loop", i);
+  }
+}
+
+// One control tick of a channel
+static void regulate(uint8_t channel, float dt) {
+  FanChannel &fan = channels[channel];
+  FanCalibration cal = getFanCalibration(channel);
+  if (!config.fan_closed_loop || !cal.valid) {
+    fan.target_rpm = NAN;
+    fan.integral = 0.0f;
+    // Duty on the output, a switch to closed loop starts from there
+    fan.duty = rampDuty(channel, std::isnan(fan.power) ? 0.0f : fan.power);
+    return;
+  }
+  float setpoint = fan.power;
+  float rpm = fan_pulse_counters[channel].rpm();
+  if (std::isnan(setpoint) || setpoint <= 0.0f) {
+    // Off, no need to regulate
+    fan.target_rpm = 0.0f;
+    fan.integral = 0.0f;
+    fan.duty = 0.0f;
+    writeDuty(channel, 0.0f);
+    fan.last_rpm = rpm;
+    return;
+  }
+  float target = cal.rpm_min + setpoint * (cal.rpm_max - cal.rpm_min);
+  fan.target_rpm = target;
+  float error = (target - rpm) / cal.rpm_max;
+  float derivative = -(rpm - fan.last_rpm) / cal.rpm_max / dt;
+  fan.last_rpm = rpm;
+  float feedforward = FAN_MIN_DUTY + setpoint * (1.0f - FAN_MIN_DUTY);
+  float output =
+      feedforward + FAN_KP * error + fan.integral + FAN_KD * derivative;
+  // Only integrate while that does not push further into saturation
+  if (!(output >= 1.0f && error > 0.0f) && !(output <= 0.0f && error < 0.0f))
+    fan.integral = clamp(fan.integral + FAN_KI * error * dt,
+                         -FAN_INTEGRAL_LIMIT, FAN_INTEGRAL_LIMIT);
+  output = clamp(output, 0.0f, 1.0f);
+  float max_step = FAN_SLEW_PER_S * dt;
+  fan.duty = clamp(output, fan.duty - max_step, fan.duty + max_step);
+  writeDuty(channel, fan.duty);
+}
+
+// PID on tach feedback with feedforward, conditional integration as
+// anti-windup and a slew limit on the output duty, per channel
+void fanControlTask(void *parameter) {
+  const float dt = 1.0f / FAN_CONTROL_HZ;
+  TickType_t last_wake = xTaskGetTickCount();
+  while (true) {
+    vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(1000 / FAN_CONTROL_HZ));
+    if (pwm_requested)
+      applyPwm();
+    if (tach_requested) {
+      tach_requested = false;
+      beginFanTach((TachMode)requested_tach);
+    }
+    if (calibration_requested) {
+      calibration_requested = false;
+      FanCalibration results[FAN_MAX_CHANNELS];
+      calibrate(results);
+      portENTER_CRITICAL(&calibration_lock);
+      for (uint8_t i = 0; i < channel_count; i++)
+        channels[i].calibration = results[i];
+      portEXIT_CRITICAL(&calibration_lock);
+      for (uint8_t i = 0; i < channel_count; i++) {
+        FanChannel &fan = channels[i];
+        // Start from the FAN_MIN_DUTY calibration left the output at,
+        // either mode moves on to the setpoint from here: closed loop
+        // through the slew limit, open loop as a fade
+        fan.integral = 0.0f;
+        fan.duty = fan.pwm.read();
+        fan.last_rpm = fan_pulse_counters[i].rpm();
+      }
+      last_wake = xTaskGetTickCount();
+      continue;
+    }
+    for (uint8_t i = 0; i < channel_count; i++)
+      regulate(i, dt);
+  }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "pwm.h"
+#include "tach.h"
+
+#include <stdint.h>
+
+// Closed-loop control rate
+#define FAN_CONTROL_HZ 20
+// Open loop ramps run one hardware fade segment per control tick, shorter
+// than the tick so it has ended when the next one retargets
+#define FAN_FADE_SEGMENT_MS 40
+// Lowest duty used during calibration, setpoint 0..1 maps onto the RPM range
+// measured at this duty and at full duty
+#define FAN_MIN_DUTY 0.2f
+// Settle time per calibration step
+#define FAN_CALIBRATION_MS 3000
+// Below this full-duty RPM the tach is considered missing (open loop only)
+#define FAN_MIN_CALIBRATED_RPM 100.0f
+// PID gains, the error is normalized to the calibrated maximum RPM
+#define FAN_KP 0.6f
+#define FAN_KI 1.5f
+#define FAN_KD 0.0f
+// Integrator clamp (duty units)
+#define FAN_INTEGRAL_LIMIT 0.5f
+// Maximum duty change per second
+#define FAN_SLEW_PER_S 0.5f
+
+// RPM range measured at boot
+struct FanCalibration {
+  float rpm_min = 0.0f; // RPM at FAN_MIN_DUTY
+  float rpm_max = 0.0f; // RPM at full duty
+  bool valid = false;
+};
+
+// Configure the PWM outputs of the fitted channels from config, call once
+// before using the fans
+void beginFan();
+// Fan channels in use, config.fan_channels as of boot
+uint8_t fanChannels();
+// Change PWM frequency and resolution of every channel, persisted on success
+// and applied by the control task on its next tick
+bool setFanPwm(uint32_t freq, uint8_t bits);
+// (Re)start the tachometer of every channel in the given mode, before the
+// control task runs
+void beginFanTach(TachMode mode);
+// Switch the tachometer mode from another task, applied by the control task
+// on its next tick
+void setFanTachMode(TachMode mode);
+
+// Per channel, channel 0 when omitted
+FanCalibration getFanCalibration(uint8_t channel = 0);
+// Duty the PWM outputs right now, trails the setpoint while a fade runs
+float getFanDuty(uint8_t channel = 0);
+// Target RPM for the current setpoint, NaN in open loop
+float getFanTargetRpm(uint8_t channel = 0);
+// Request a new calibration run of every channel from the control task
+void calibrateFan();
+
+// Fan control task function
+void fanControlTask(void *parameter);
@@ -0,0 +1,160 @@
+#include "frame.h"
+#include "global.h"
+#include "perf.h"
+
+#include <cmath>
+#include <esp_mac.h>
+#include <string.h>
+
+void FrameWriter::put(const void *data, size_t size) {
+  if (len + size > cap) {
+    overflow = true;
+    return;
+  }
+  memcpy(buf + len, data, size);
+  len += size;
+}
+
+static void writeHeader(uint8_t *buf, FrameType type, uint32_t seq,
+                        uint32_t uptime) {
+  static uint8_t device[6] = {};
+  static bool device_read = false;
+  if (!device_read) {
+    esp_read_mac(device, ESP_MAC_WIFI_STA);
+    device_read = true;
+  }
+  FrameHeader header;
+  header.magic = FRAME_MAGIC;
+  header.version = FRAME_VERSION;
+  header.type = type;
+  memcpy(header.device, device, sizeof(header.device));
+  header.seq = seq;
+  header.uptime = uptime;
+  memcpy(buf, &header, sizeof(header));
+}
+
+static int16_t toFixed(float value, float scale) {
+  float scaled = roundf(value / scale);
+  if (std::isnan(scaled) || scaled <= INT16_MIN || scaled > INT16_MAX)
+    return FRAME_NAN;
+  return (int16_t)scaled;
+}
+
+static_assert(FIELD_SENSOR_TEMPERATURE + 2 * (MAX_SENSORS - 1) <=
+                  FIELD_FAN_CHANNEL_RPM,
+              "Sensor fields overlap the fan channel fields");
+static_assert(FIELD_FAN_CHANNEL_RPM + 2 * (FAN_MAX_CHANNELS - 1) <= 32,
+              "Not enough mask bits for every fan channel");
+
+// Status fields in mask order
+static const uint32_t STATUS_MASK =
+    1UL << FIELD_TEMPERATURE | 1UL << FIELD_HUMIDITY | 1UL << FIELD_FAN_RPM |
+    1UL << FIELD_FAN_POWER | 1UL << FIELD_FLAGS;
+static const size_t STATUS_FIELDS = FRAME_BATCH_FIELDS;
+
+static void statusValues(const Status &status, int16_t *values) {
+  values[0] = toFixed(status.temperature, 0.01f);
+  values[1] = toFixed(status.humidity, 0.01f);
+  values[2] = toFixed(status.fan_rpm, 1.0f);
+  values[3] = toFixed(status.fan_power, 0.0001f);
+  values[4] = (int16_t)status.flags;
+}
+
+FrameWriter::FrameWriter(uint8_t *buf, size_t cap, FrameType type,
+                         uint32_t seq, uint32_t uptime)
+    : buf(buf), cap(cap) {
+  if (cap < sizeof(FrameHeader)) {
+    overflow = true;
+    return;
+  }
+  writeHeader(buf, type, seq, uptime);
+  len = sizeof(FrameHeader);
+  mask_at = len;
+  put(&mask, sizeof(mask));
+}
+
+void FrameWriter::field(FrameField id, int16_t value) {
+  put(&value, sizeof(value));
+  if (overflow)
+    return;
+  mask |= 1UL << id;
+  memcpy(buf + mask_at, &mask, sizeof(mask));
+}
+
+void FrameWriter::field(FrameField id, float value, float scale) {
+  field(id, toFixed(value, scale));
+}
+
+size_t encodeStatus(const Status &status, uint32_t seq, uint16_t curve,
+                    const PerfSnapshot *perf, uint8_t *buf, size_t cap) {
+  FrameWriter frame(buf, cap, FRAME_STATUS, seq, status.sampled_at);
+  int16_t values[STATUS_FIELDS];
+  statusValues(status, values);
+  for (uint8_t id = 0, i = 0; id < 32; id++)
+    if (STATUS_MASK & (1UL << id))
+      frame.field((FrameField)id, values[i++]);
+  frame.field(FIELD_CURVE, (int16_t)curve);
+  if (perf) {
+    frame.field(FIELD_HEAP_FREE,
+                (int16_t)min(perf->heap_free_kb, (uint16_t)INT16_MAX));
+    frame.field(FIELD_HEARTBEAT_FAILURES, (int16_t)perf->heartbeat_failures);
+    frame.field(FIELD_RECONNECTS, (int16_t)perf->reconnects);
+    frame.field(FIELD_POST_LATENCY,
+                (int16_t)min(perf->post_ms, (uint16_t)INT16_MAX));
+  }
+  for (uint8_t i = 1; i < status.sensor_count; i++) {
+    uint8_t id = FIELD_SENSOR_TEMPERATURE + 2 * (i - 1);
+    frame.field((FrameField)id, status.sensors[i].temperature, 0.01f);
+    frame.field((FrameField)(id + 1), status.sensors[i].humidity, 0.01f);
+  }
+  for (uint8_t i = 1; i < status.fan_count; i++) {
+    uint8_t id = FIELD_FAN_CHANNEL_RPM + 2 * (i - 1);
+    frame.field((FrameField)id, status.fans[i].rpm, 1.0f);
+    frame.field((FrameField)(id + 1), status.fans[i].power, 0.0001f);
+  }
+  return frame.size();
+}
+
+// Header, mask, count, base uptime
+static const size_t BATCH_PREFIX =
+    sizeof(FrameHeader) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint32_t);
+static const size_t BATCH_RECORD = sizeof(uint16_t) * (1 + STATUS_FIELDS);
+
+BatchWriter::BatchWriter(uint8_t *buf, size_t cap, uint32_t seq, uint32_t now)
+    : buf(buf), cap(cap) {
+  if (cap < BATCH_PREFIX)
+    return;
+  writeHeader(buf, FRAME_BATCH, seq, now);
+  memcpy(buf + sizeof(FrameHeader), &STATUS_MASK, sizeof(STATUS_MASK));
+  len = BATCH_PREFIX;
+}
+
+BatchRecord batchRecord(const Status &status) {
+  BatchRecord record;
+  record.uptime = status.sampled_at;
+  statusValues(status, record.values);
+  return record;
+}
+
+bool BatchWriter::add(const BatchRecord &sample) {
+  if (len == 0 || len + BATCH_RECORD > cap || count == UINT16_MAX)
+    return false;
+  if (count == 0) {
+    memcpy(buf + BATCH_PREFIX - sizeof(uint32_t), &sample.uptime,
+           sizeof(uint32_t));
+    last_uptime = sample.uptime;
+  }
+  uint32_t delta = sample.uptime - last_uptime;
+  // Gaps too long for the delta start a new batch
+  if (delta > UINT16_MAX)
+    return false;
+  uint16_t record[1 + STATUS_FIELDS];
+  record[0] = (uint16_t)delta;
+  memcpy(&record[1], sample.values, sizeof(sample.values));
+  memcpy(buf + len, record, sizeof(record));
+  len += sizeof(record);
+  last_uptime = sample.uptime;
+  count++;
+  memcpy(buf + sizeof(FrameHeader) + sizeof(uint32_t), &count, sizeof(count));
+  return true;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Status;
+struct PerfSnapshot;
+
+// Telemetry wire format, all integers little-endian.
+//
+//   FrameHeader (18 bytes)
+//   uint32_t field mask, bit N set if field N is present
+//   int16_t  value per present field, in ascending bit order
+//
+// Every field is a 2-byte fixed-point value, so a reader can skip fields it
+// does not know by counting the bits above the ones it understands. New
+// fields only ever take the next free bit, FRAME_VERSION is reserved for
+// changes a reader can't skip over.
+//
+// A batch frame replays samples buffered during an outage. The header
+// uptime is the send time, followed by
+//
+//   uint32_t field mask, shared by all records
+//   uint16_t record count
+//   uint32_t uptime of the first record
+//   per record: uint16_t ms since the previous record (0 for the first),
+//               then one int16_t per field as above
+#define FRAME_MAGIC 0xAC5A
+#define FRAME_VERSION 1
+#define FRAME_MAX_SIZE 64
+#define FRAME_BATCH_MAX_SIZE 512
+// Missing or NaN value
+#define FRAME_NAN INT16_MIN
+// Fields per batch record, temperature, humidity, fan RPM, fan power, flags
+#define FRAME_BATCH_FIELDS 5
+
+enum FrameType : uint8_t {
+  FRAME_STATUS = 1,
+  FRAME_BATCH = 2,
+};
+
+// Field ids (mask bit) and fixed-point scale
+enum FrameField : uint8_t {
+  FIELD_TEMPERATURE = 0, // 0.01 °C
+  FIELD_HUMIDITY = 1,    // 0.01 %
+  FIELD_FAN_RPM = 2,     // 1 RPM
+  FIELD_FAN_POWER = 3,   // 0.0001 (0..10000)
+  FIELD_FLAGS = 4,       // Bitfield of FrameFlag
+  FIELD_CURVE = 5,       // Cached fallback curve revision, status frames only
+  // Device stats, status frames only and only while enabled
+  FIELD_HEAP_FREE = 6,          // 1 KiB
+  FIELD_HEARTBEAT_FAILURES = 7, // Count since boot, wraps at 65536
+  FIELD_RECONNECTS = 8,         // Count since boot, wraps at 65536
+  FIELD_POST_LATENCY = 9,       // 1 ms, last telemetry round trip
+  // Additional sensors, status frames only, a pair per sensor after the
+  // primary one which reports as FIELD_TEMPERATURE / FIELD_HUMIDITY
+  FIELD_SENSOR_TEMPERATURE = 10, // 0.01 °C, second sensor
+  FIELD_SENSOR_HUMIDITY = 11,    // 0.01 %, second sensor
+  // Additional fan channels, status frames only, a pair per channel after
+  // channel 0 which reports as FIELD_FAN_RPM / FIELD_FAN_POWER
+  FIELD_FAN_CHANNEL_RPM = 12,   // 1 RPM, channel 1, 14 for channel 2
+  FIELD_FAN_CHANNEL_POWER = 13, // 0.0001, channel 1, 15 for channel 2
+};
+
+enum FrameFlag : uint16_t {
+  FLAG_FAN_STALLED = 1 << 0,
+  FLAG_CLOSED_LOOP = 1 << 1,
+  FLAG_LOCAL_CONTROL = 1 << 2, // Fan driven by the fallback curve
+};
+
+struct __attribute__((packed)) FrameHeader {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t type;
+  uint8_t device[6]; // Station MAC address
+  uint32_t seq;      // Incremented per frame, restarts at boot
+  uint32_t uptime;   // Device millis() when the payload was sampled
+};
+
+// Writes a frame in place into a caller-provided buffer
+class FrameWriter {
+private:
+  uint8_t *buf;
+  size_t cap;
+  size_t len = 0;
+  size_t mask_at = 0;
+  uint32_t mask = 0;
+  bool overflow = false;
+
+  void put(const void *data, size_t size);
+
+public:
+  FrameWriter(uint8_t *buf, size_t cap, FrameType type, uint32_t seq,
+              uint32_t uptime);
+  // Fields must be added in ascending id order
+  void field(FrameField id, int16_t value);
+  void field(FrameField id, float value, float scale);
+  // Encoded length, 0 if the buffer was too small
+  size_t size() const { return overflow ? 0 : len; }
+};
+
+// Encode a status sample, the fallback curve revision and optionally device
+// stats, returns the frame length
+size_t encodeStatus(const Status &status, uint32_t seq, uint16_t curve,
+                    const PerfSnapshot *perf, uint8_t *buf, size_t cap);
+
+// Status sample reduced to what a batch frame carries, fields already in
+// fixed point. Kept instead of the whole Status while samples are buffered.
+struct BatchRecord {
+  uint32_t uptime;
+  int16_t values[FRAME_BATCH_FIELDS];
+};
+
+BatchRecord batchRecord(const Status &status);
+
+// Writes a batch of status samples in place, delta-encoding their uptime
+class BatchWriter {
+private:
+  uint8_t *buf;
+  size_t cap;
+  size_t len = 0;
+  uint16_t count = 0;
+  uint32_t last_uptime = 0;
+
+public:
+  BatchWriter(uint8_t *buf, size_t cap, uint32_t seq, uint32_t now);
+  // Returns false if the sample does not fit, the batch is then complete
+  bool add(const BatchRecord &record);
+  uint16_t records() const { return count; }
+  size_t size() const { return len; }
+};
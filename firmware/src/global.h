@@ -3,50 +3,106 @@
 #include <Arduino.h>
 #include <FastLED.h>
 #include <Preferences.h>
-#include <SHT31.h>
+
+#include "frame.h"
+#include "logger.h"
+#include "pwm.h"
+#include "relay.h"
+#include "seqlock.h"
+#include "sensors.h"
+#include "tach.h"
+#include "telemetry.h"
 
 // Hardware definitions
 #define NUM_LEDS 8
 #define LED_PIN D6
-#define FAN_PWM D3
-#define FAN_TCH D2
+// Fan channels, PWM output and tach input pin per channel
+#define FAN_MAX_CHANNELS 3
+#define FAN_PWM_PINS {D3, D5, D9}
+#define FAN_TCH_PINS {D2, D4, D8}
 
 #define IIC_SCL A5
 #define IIC_SDA A4
 
-// FanPulseCounter class definition
-class FanPulseCounter {
-private:
-  unsigned long last_check = micros();
-  unsigned long count;
-
-public:
-  inline void tick() { count++; }
-  inline float rpm() {
-    unsigned long now = micros();
-    float dt = (now - last_check) * 1e-6; // seconds
-    last_check = now;
-    float rpm = 60.0 * ((float)count / dt) / 2.0; // 2 pulses per revolution
-    count = 0;
-    return rpm; // convert to RPM
-  }
+// Default sensor sampling period, and the accepted range
+#define SAMPLE_INTERVAL_MS 1000
+#define SAMPLE_INTERVAL_MIN_MS 20
+#define SAMPLE_INTERVAL_MAX_MS 60000
+
+// Per-channel fan state
+struct FanReading {
+  float rpm = 0.0f;
+  float power = NAN; // Setpoint
 };
 
 // Status struct definition
 struct Status {
-  float temperature = NAN;
+  float temperature = NAN; // Primary sensor, the first one found
   float humidity = NAN;
-  float fan_rpm = 0.0f;
-  struct Status &update();
+  SensorReading sensors[MAX_SENSORS]; // Every sensor, in sensorAddress() order
+  uint8_t sensor_count = 0;
+  float fan_rpm = 0.0f;    // Channel 0
+  float fan_power = NAN;   // Channel 0 setpoint at sampling time
+  FanReading fans[FAN_MAX_CHANNELS]; // Every channel, count below
+  uint8_t fan_count = 0;
+  uint16_t flags = 0;      // FrameFlag bits
+  uint32_t sampled_at = 0; // millis() of the sample
+  struct Status &update(bool low_repeatability = false);
+};
+
+// Default telemetry report policy
+#define REPORT_HEARTBEAT_MS 5000
+#define REPORT_DEADBAND_TEMPERATURE 0.1f // °C
+#define REPORT_DEADBAND_HUMIDITY 0.5f    // %
+#define REPORT_DEADBAND_RPM 50.0f
+
+// Config struct definition, RAM cache of the settings kept in Preferences.
+// Loaded once at boot, written through by the console.
+struct Config {
+  char ssid[33] = "";
+  char passwd[65] = "";
+  char server[128] = "";
+  char domain[33] = ""; // Server discovery domain, empty keeps the URL
+  uint32_t sample_interval = SAMPLE_INTERVAL_MS; // Sensor sampling period (ms)
+  bool sensor_low_repeatability = false; // Fast, noisier SHT31 conversions
+  uint8_t tach_mode = TACH_PERIOD;       // Fan tachometer counting mode
+  bool fan_closed_loop = true;           // Regulate RPM instead of duty
+  uint32_t fan_pwm_freq = FAN_PWM_FREQ;  // Fan PWM frequency (Hz)
+  uint8_t fan_pwm_bits = FAN_PWM_BITS;   // Fan PWM duty resolution
+  uint8_t fan_channels = 1; // Fitted fans, applied at boot
+  uint32_t fan_ramp = FAN_RAMP_MS; // Open loop fade time per full swing (ms)
+  uint8_t relay_mode = RELAY_OFF;  // RelayMode, applied at boot
+  uint32_t report_heartbeat = REPORT_HEARTBEAT_MS; // Max silence (ms)
+  uint8_t transport = TRANSPORT_HTTP; // TelemetryTransport
+  float deadband_temperature = REPORT_DEADBAND_TEMPERATURE;
+  float deadband_humidity = REPORT_DEADBAND_HUMIDITY;
+  float deadband_rpm = REPORT_DEADBAND_RPM;
+  bool power_save = false; // Modem sleep and reduced clock while idle
+  bool wifi_static = false; // Reuse the last DHCP lease on fast reconnect
+  uint8_t log_level = LOG_INFO; // LogLevel, lower levels are dropped
+  bool perf_telemetry = false;  // Send device stats with status frames
+  uint32_t revision = 0; // Incremented on every change
+
+  void load();
+  void save(const char *ns, const char *key, const char *value);
+  void save(const char *ns, const char *key, uint32_t value);
+  void save(const char *ns, const char *key, bool value);
+  void save(const char *ns, const char *key, uint8_t value);
+  void save(const char *ns, const char *key, float value);
+  void wipe();
+  // Copy into local if it is older than this config, returns true if copied
+  bool refresh(Config &local) const;
 };
 
 // Global singleton declarations (defined in main.cpp)
 extern CRGB leds[NUM_LEDS];
-extern SHT31 sht;
-extern Preferences preferences;
-extern FanPulseCounter fan_pulse_counter;
-extern Status status;
-extern volatile bool wifi_connected;
+extern Config config;
+extern FanPulseCounter fan_pulse_counters[FAN_MAX_CHANNELS];
+extern Seqlock<Status> status; // Latest sample, written by the sampler task
 
+// Fan setpoint of one channel, or of every channel at once. Returns the
+// applied (clamped) power. getFanPower() is the target, see getFanDuty()
+// in fan.h for the output while ramping.
+float setFanPower(uint8_t channel, float power);
 float setFanPower(float power);
-float getFanPower();
\ No newline at end of file
+float getFanPower(uint8_t channel = 0);
\ No newline at end of file
@@ -1,40 +1,263 @@
 #include "led.h"
+#include "global.h"
+#include "perf.h"
+#include "power.h"
+#include "tasks.h"
+
 #include <cmath>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
 
 // 0.0-1.0 for h, s, l
 CRGB hsl(float h, float s, float l) {
-  float c = (1.0f - fabs(2.0f * l - 1.0f)) * s;
-  float x = c * (1.0f - fabs(fmod(h * 6.0f, 2.0f) - 1.0f));
-  float m = l - c / 2.0f;
-
-  float r, g, b;
-
-  if (h < 1.0f / 6.0f) {
-    r = c;
-    g = x;
-    b = 0;
-  } else if (h < 2.0f / 6.0f) {
-    r = x;
-    g = c;
-    b = 0;
-  } else if (h < 3.0f / 6.0f) {
-    r = 0;
-    g = c;
-    b = x;
-  } else if (h < 4.0f / 6.0f) {
-    r = 0;
-    g = x;
-    b = c;
-  } else if (h < 5.0f / 6.0f) {
-    r = x;
-    g = 0;
-    b = c;
-  } else {
-    r = c;
-    g = 0;
-    b = x;
+  return hsl8((uint8_t)(constrain(h, 0.0f, 1.0f) * 255.0f + 0.5f),
+              (uint8_t)(constrain(s, 0.0f, 1.0f) * 255.0f + 0.5f),
+              (uint8_t)(constrain(l, 0.0f, 1.0f) * 255.0f + 0.5f));
+}
+
+// Same six-sector conversion as the float version, in 8-bit fixed point
+CRGB hsl8(uint8_t h, uint8_t s, uint8_t l) {
+  uint8_t spread = 255 - abs(2 * l - 255);
+  uint8_t c = scale8(spread, s);
+  uint8_t m = l - c / 2;
+
+  // Hue sector and the position inside it
+  uint16_t scaled = h * 6;
+  uint8_t sector = scaled >> 8;
+  uint8_t frac = scaled & 0xff;
+  uint8_t x = scale8(c, sector & 1 ? 255 - frac : frac);
+
+  uint8_t r, g, b;
+  switch (sector) {
+  case 0:
+    r = c, g = x, b = 0;
+    break;
+  case 1:
+    r = x, g = c, b = 0;
+    break;
+  case 2:
+    r = 0, g = c, b = x;
+    break;
+  case 3:
+    r = 0, g = x, b = c;
+    break;
+  case 4:
+    r = x, g = 0, b = c;
+    break;
+  default:
+    r = c, g = 0, b = x;
+    break;
+  }
+  return CRGB(qadd8(r, m), qadd8(g, m), qadd8(b, m));
+}
+
+bool showColor(CRGB color) {
+  static CRGB shown;
+  static bool shown_once = false;
+  if (shown_once && color == shown)
+    return false;
+  for (auto &l : leds)
+    l = color;
+  PerfTimer timer(PERF_LED_SHOW);
+  FastLED.show();
+  shown = color;
+  shown_once = true;
+  return true;
+}
+
+// Hue follows the target at 0.5 hue units per second, taking the short way
+// around the circle
+class TransitionEffect : public LedEffect {
+private:
+  float hue = 0.0f;
+  float target = 0.0f;
+  uint32_t last = 0;
+
+public:
+  void setTarget(float value) { target = value; }
+
+  uint32_t render(uint32_t now, CRGB &color) override {
+    float dt = last == 0 ? 0.0f : (now - last) / 1000.0f;
+    last = now;
+    float diff = target - hue;
+    if (diff > 0.5f)
+      diff -= 1.0f;
+    if (diff < -0.5f)
+      diff += 1.0f;
+    float step = 0.5f * dt;
+    if (fabsf(diff) <= step)
+      hue = target;
+    else
+      hue += diff > 0 ? step : -step;
+    if (hue < 0.0f)
+      hue += 1.0f;
+    if (hue >= 1.0f)
+      hue -= 1.0f;
+    color = hsl8(hue * 255.0f + 0.5f, 255, 128);
+    // 60 Hz while moving
+    return hue == target ? 0 : 16;
+  }
+};
+
+// Square wave between full and a dim level
+class BlinkEffect : public LedEffect {
+private:
+  uint16_t half_period;
+  uint8_t dim;
+
+public:
+  BlinkEffect(uint16_t half_period, uint8_t dim)
+      : half_period(half_period), dim(dim) {}
+
+  uint32_t render(uint32_t now, CRGB &color) override {
+    if ((now / half_period) & 1)
+      color.nscale8(dim);
+    // Only wakes at the edges
+    return half_period - now % half_period;
+  }
+};
+
+// Sine wave from off to full brightness
+class BreatheEffect : public LedEffect {
+private:
+  uint16_t period;
+
+public:
+  BreatheEffect(uint16_t period) : period(period) {}
+
+  uint32_t render(uint32_t now, CRGB &color) override {
+    color.nscale8(sin8((now % period) * 256 / period));
+    return 33;
+  }
+};
+
+// Red blinks, one per unit of the code, then a pause
+class ErrorEffect : public LedEffect {
+private:
+  uint8_t code = LED_ERROR_NONE;
+  uint32_t started = 0;
+
+public:
+  void setCode(uint8_t value, uint32_t now) {
+    if (value != code)
+      started = now;
+    code = value;
+  }
+  bool active() const { return code != LED_ERROR_NONE; }
+
+  uint32_t render(uint32_t now, CRGB &color) override {
+    const uint32_t pulse = 200, pause = 1000;
+    uint32_t cycle = code * 2 * pulse + pause;
+    uint32_t t = (now - started) % cycle;
+    uint32_t next;
+    if (t < code * 2 * pulse) {
+      color = (t / pulse) & 1 ? CRGB::Black : CRGB::Red;
+      next = pulse - t % pulse;
+    } else {
+      color = CRGB::Black;
+      next = cycle - t;
+    }
+    return next;
+  }
+};
+
+struct LedEvent {
+  LedEventType type;
+  float value;
+};
+
+static QueueHandle_t led_events = nullptr;
+static TaskHandle_t led_task = nullptr;
+static esp_timer_handle_t frame_timer = nullptr;
+
+static void onFrame(void *arg) { xTaskNotifyGive(led_task); }
+
+static void ledTask(void *parameter) {
+  TransitionEffect transition;
+  BlinkEffect blink(100, 26); // 5 Hz while WiFi is down
+  BreatheEffect breathe(1000); // 1 Hz while the server is not in control
+  ErrorEffect error;
+  float fan_power = NAN;
+  bool connected = false;
+  bool controlled = false;
+
+  while (true) {
+    // Woken by a queued event or a frame tick
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    uint32_t now = millis();
+    LedEvent event;
+    while (xQueueReceive(led_events, &event, 0) == pdTRUE) {
+      switch (event.type) {
+      case LED_EVENT_FAN_POWER:
+        fan_power = event.value;
+        // 0% = red (0.0), 100% = blue (0.667)
+        transition.setTarget(std::isnan(fan_power) ? 0.0f
+                                                   : fan_power * 0.667f);
+        break;
+      case LED_EVENT_WIFI:
+        connected = event.value != 0.0f;
+        break;
+      case LED_EVENT_CONTROL:
+        controlled = event.value != 0.0f;
+        break;
+      case LED_EVENT_ERROR:
+        error.setCode((uint8_t)event.value, now);
+        break;
+      case LED_EVENT_REFRESH:
+        break;
+      }
+    }
+
+    CRGB color;
+    uint32_t next = transition.render(now, color);
+    LedEffect *overlay = nullptr;
+    if (error.active())
+      overlay = &error;
+    else if (!connected)
+      overlay = &blink;
+    else if (std::isnan(fan_power) || !controlled)
+      overlay = &breathe;
+    if (overlay) {
+      uint32_t overlay_next = overlay->render(now, color);
+      if (next == 0 || (overlay_next != 0 && overlay_next < next))
+        next = overlay_next;
+    }
+    showColor(color);
+
+    // Nothing animates while connected, under control and at the target hue
+    updatePowerMode(next == 0 && connected);
+    esp_timer_stop(frame_timer);
+    if (next != 0)
+      esp_timer_start_once(frame_timer, next * 1000ULL);
   }
+}
+
+void beginLed() {
+  led_events = xQueueCreate(16, sizeof(LedEvent));
+  esp_timer_create_args_t args = {};
+  args.callback = onFrame;
+  args.name = "led_frame";
+  esp_timer_create(&args, &frame_timer);
+  xTaskCreatePinnedToCore(ledTask,      // Task function
+                          "Led",        // Task name
+                          STACK_LED,    // Stack size (bytes)
+                          NULL,         // Parameter
+                          PRIORITY_LED, // Priority
+                          &led_task,    // Task handle
+                          CORE_CONTROL  // Core
+  );
+  // Render the initial frame
+  ledSignal(LED_EVENT_FAN_POWER, getFanPower());
+}
 
-  return CRGB((uint8_t)((r + m) * 255), (uint8_t)((g + m) * 255),
-              (uint8_t)((b + m) * 255));
+void ledSignal(LedEventType type, float value) {
+  if (!led_events)
+    return;
+  LedEvent event = {type, value};
+  // A full queue drops the event, the task is woken either way
+  xQueueSend(led_events, &event, 0);
+  if (led_task)
+    xTaskNotifyGive(led_task);
 }
@@ -4,3 +4,40 @@
 
 // Convert HSL (0.0-1.0 for h, s, l) to RGB color
 CRGB hsl(float h, float s, float l);
+
+// Integer HSL (0-255 for h, s, l), hue 256 wraps back to red
+CRGB hsl8(uint8_t h, uint8_t s, uint8_t l);
+
+// Set every LED to the color, FastLED.show() only runs if it changed.
+// Returns true if the strip was updated.
+bool showColor(CRGB color);
+
+// State changes the LED reflects, sent by the tasks that own the state
+enum LedEventType : uint8_t {
+  LED_EVENT_FAN_POWER, // value: fan power setpoint, NaN if none
+  LED_EVENT_WIFI,      // value: 1 connected, 0 disconnected
+  LED_EVENT_CONTROL,   // value: 1 while server replies are fresh
+  LED_EVENT_ERROR,     // value: LedError code
+  LED_EVENT_REFRESH,   // Re-render, e.g. after a settings change
+};
+
+// Error codes, shown as that many red blinks followed by a pause
+enum LedError : uint8_t {
+  LED_ERROR_NONE = 0,
+  LED_ERROR_FAN_STALLED = 2,
+  LED_ERROR_SENSOR = 3,
+};
+
+// Rendering a frame takes the color of the effects below it and returns the
+// ms until the next frame, or 0 if the effect is static
+class LedEffect {
+public:
+  virtual uint32_t render(uint32_t now, CRGB &color) = 0;
+};
+
+// Start the LED task, frames are scheduled by an esp_timer and only while
+// an effect is animating
+void beginLed();
+
+// Queue a state change for the LED task, never blocks
+void ledSignal(LedEventType type, float value = 0.0f);
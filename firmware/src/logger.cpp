@@ -0,0 +1,71 @@
+#include "logger.h"
+#include "global.h"
+
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/ringbuf.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+static RingbufHandle_t log_buffer = nullptr;
+static std::atomic<uint32_t> dropped{0};
+
+// Header of a queued record, the message follows without its terminator
+struct __attribute__((packed)) LogHeader {
+  uint32_t timestamp;
+  LogLevel level;
+};
+
+void beginLog() {
+  log_buffer = xRingbufferCreate(LOG_BUFFER_SIZE, RINGBUF_TYPE_NOSPLIT);
+}
+
+void log(LogLevel level, const char *format, ...) {
+  if (level < config.log_level || !log_buffer)
+    return;
+  // Not formatted in interrupt context, counted so the misuse shows up
+  if (xPortInIsrContext()) {
+    dropped++;
+    return;
+  }
+  uint8_t item[sizeof(LogHeader) + LOG_MESSAGE_MAX];
+  LogHeader header = {millis(), level};
+  memcpy(item, &header, sizeof(header));
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf((char *)item + sizeof(header), LOG_MESSAGE_MAX,
+                         format, args);
+  va_end(args);
+  if (length < 0)
+    return;
+  if (length >= LOG_MESSAGE_MAX)
+    length = LOG_MESSAGE_MAX - 1;
+  size_t size = sizeof(header) + length;
+  if (xRingbufferSend(log_buffer, item, size, 0) != pdTRUE)
+    dropped++;
+}
+
+bool nextLogRecord(LogRecord &record, uint32_t ticks) {
+  if (!log_buffer)
+    return false;
+  size_t size;
+  void *item = xRingbufferReceive(log_buffer, &size, ticks);
+  if (!item)
+    return false;
+  LogHeader header;
+  memcpy(&header, item, sizeof(header));
+  record.timestamp = header.timestamp;
+  record.level = header.level;
+  size_t length = size - sizeof(header);
+  memcpy(record.message, (uint8_t *)item + sizeof(header), length);
+  record.message[length] = '\0';
+  vRingbufferReturnItem(log_buffer, item);
+  return true;
+}
+
+uint32_t takeDroppedLogs() { return dropped.exchange(0); }
+
+const char *logLevelName(LogLevel level) {
+  static const char *names[] = {"debug", "info", "warn", "error"};
+  return level <= LOG_ERROR ? names[level] : "?";
+}
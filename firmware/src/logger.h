@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log records are queued into a ring buffer and printed by the console
+// task, so callers never wait on the UART. Safe from any task, not from an
+// ISR: formatting runs newlib's vsnprintf, floats included.
+#define LOG_BUFFER_SIZE 4096
+// Longest message, longer ones are truncated
+#define LOG_MESSAGE_MAX 120
+// Recent lines kept for "log dump"
+#define LOG_HISTORY 32
+
+enum LogLevel : uint8_t {
+  LOG_DEBUG = 0,
+  LOG_INFO = 1,
+  LOG_WARN = 2,
+  LOG_ERROR = 3,
+  // Output of console commands running off the console task, queued so it
+  // keeps its place among log lines but printed as is at any log level
+  LOG_CONSOLE = 4,
+};
+
+struct LogRecord {
+  uint32_t timestamp; // millis() when logged
+  LogLevel level;
+  char message[LOG_MESSAGE_MAX];
+};
+
+// Create the ring buffer, call first thing in setup()
+void beginLog();
+
+// printf-style log, dropped if below the configured level or the buffer is
+// full
+void log(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Take the next queued record, waits up to ticks. Console task only.
+bool nextLogRecord(LogRecord &record, uint32_t ticks);
+
+// Records dropped since the last call because the buffer was full
+uint32_t takeDroppedLogs();
+
+const char *logLevelName(LogLevel level);
@@ -0,0 +1,364 @@
+#include "ota.h"
+#include "connection.h"
+#include "global.h"
+#include "logger.h"
+#include "tasks.h"
+
+#include <HTTPClient.h>
+#include <Update.h>
+#include <WiFi.h>
+#include <esp_ota_ops.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mbedtls/ecdsa.h>
+#include <mbedtls/sha256.h>
+#include <rom/miniz.h>
+
+#define GZIP_MAGIC 0x8b1f
+
+static volatile bool pending = false;
+static volatile bool running = false;
+static esp_timer_handle_t confirm_timer = nullptr;
+static char ota_url[128];
+
+// Boot the image that was running before the update
+static void rollback() {
+  Preferences preferences;
+  preferences.begin("ota", false);
+  String previous = preferences.getString("previous", "");
+  preferences.clear();
+  preferences.end();
+  const esp_partition_t *partition = esp_partition_find_first(
+      ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, previous.c_str());
+  if (partition && esp_ota_set_boot_partition(partition) == ESP_OK) {
+    log(LOG_ERROR, "OTA image not confirmed, rolling back to %s",
+        previous.c_str());
+    delay(500);
+    esp_restart();
+  }
+  log(LOG_ERROR, "OTA rollback failed, keeping the new image");
+  pending = false;
+}
+
+static void rollbackTask(void *parameter) {
+  // A heartbeat may have confirmed the image in the meantime
+  if (pending)
+    rollback();
+  vTaskDelete(NULL);
+}
+
+// Runs in the esp_timer task, which must not block, so NVS, logging and the
+// reboot delay are left to a task of their own
+static void onConfirmTimeout(void *arg) {
+  xTaskCreatePinnedToCore(rollbackTask,  // Task function
+                          "Ota",         // Task name
+                          STACK_OTA,     // Stack size (bytes)
+                          NULL,          // Parameter
+                          PRIORITY_OTA,  // Priority
+                          NULL,          // Task handle
+                          CORE_NETWORK   // Core
+  );
+}
+
+void beginOta() {
+  Preferences preferences;
+  preferences.begin("ota", false);
+  bool on_probation = preferences.getBool("pending", false);
+  uint8_t boots = on_probation ? preferences.getUChar("boots", 0) + 1 : 0;
+  if (on_probation)
+    preferences.putUChar("boots", boots);
+  preferences.end();
+  if (!on_probation)
+    return;
+  if (boots > OTA_MAX_BOOTS) {
+    // Keeps crashing before reaching the server
+    rollback();
+    return;
+  }
+  pending = true;
+  log(LOG_WARN, "OTA image on probation (boot %u), waiting for heartbeat",
+      boots);
+  esp_timer_create_args_t args = {};
+  args.callback = onConfirmTimeout;
+  args.name = "ota_confirm";
+  esp_timer_create(&args, &confirm_timer);
+  esp_timer_start_once(confirm_timer, OTA_CONFIRM_TIMEOUT_MS * 1000ULL);
+}
+
+void otaHeartbeat() {
+  if (!pending)
+    return;
+  pending = false;
+  esp_timer_stop(confirm_timer);
+  Preferences preferences;
+  preferences.begin("ota", false);
+  preferences.clear();
+  preferences.end();
+  log(LOG_INFO, "OTA image confirmed");
+}
+
+bool otaPending() { return pending; }
+
+// Inflates a gzip stream chunk by chunk into Update, using the ROM's miniz
+class GzipWriter {
+private:
+  tinfl_decompressor *inflator;
+  uint8_t *dict; // Circular output window
+  size_t dict_offset = 0;
+  bool header_done = false;
+  bool done = false;
+
+  // Skip the gzip header, returns its length or 0 if malformed
+  static size_t headerLength(const uint8_t *data, size_t length) {
+    if (length < 10 || data[2] != 8) // Deflate
+      return 0;
+    uint8_t flags = data[3];
+    size_t at = 10;
+    if (flags & 0x04) { // FEXTRA
+      if (at + 2 > length)
+        return 0;
+      at += 2 + (data[at] | data[at + 1] << 8);
+    }
+    for (uint8_t flag : {0x08, 0x10}) { // FNAME, FCOMMENT
+      if (!(flags & flag))
+        continue;
+      while (at < length && data[at] != 0)
+        at++;
+      at++;
+    }
+    if (flags & 0x02) // FHCRC
+      at += 2;
+    return at <= length ? at : 0;
+  }
+
+public:
+  GzipWriter() {
+    inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (inflator)
+      tinfl_init(inflator);
+  }
+  ~GzipWriter() {
+    free(inflator);
+    free(dict);
+  }
+
+  bool valid() const { return inflator && dict; }
+  bool finished() const { return done; }
+
+  // The header must fit in the first chunk
+  bool write(const uint8_t *data, size_t length) {
+    if (!header_done) {
+      size_t skip = headerLength(data, length);
+      if (skip == 0)
+        return false;
+      data += skip;
+      length -= skip;
+      header_done = true;
+    }
+    while (!done) {
+      size_t in_bytes = length;
+      size_t out_bytes = TINFL_LZ_DICT_SIZE - dict_offset;
+      tinfl_status status =
+          tinfl_decompress(inflator, data, &in_bytes, dict, dict + dict_offset,
+                           &out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+      data += in_bytes;
+      length -= in_bytes;
+      if (out_bytes > 0) {
+        if (Update.write(dict + dict_offset, out_bytes) != out_bytes)
+          return false;
+        dict_offset = (dict_offset + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+      }
+      if (status == TINFL_STATUS_DONE)
+        done = true;
+      else if (status < 0)
+        return false;
+      else if (length == 0 && status == TINFL_STATUS_NEEDS_MORE_INPUT)
+        break;
+      else if (in_bytes == 0 && out_bytes == 0)
+        return false;
+    }
+    return true;
+  }
+};
+
+// Fetch <url>.sig and check it against the built-in key
+static bool verifySignature(const char *url, const uint8_t *digest) {
+  uint8_t key[65];
+  const char *hex = OTA_PUBLIC_KEY;
+  if (strlen(hex) != 2 * sizeof(key)) {
+    log(LOG_ERROR, "OTA: no signing key built in");
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(key); i++) {
+    char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+    key[i] = strtoul(byte, nullptr, 16);
+  }
+  WiFiClient client;
+  HTTPClient http;
+  http.setTimeout(10000);
+  String sig_url = String(url) + ".sig";
+  if (!http.begin(client, sig_url))
+    return false;
+  int code = http.GET();
+  uint8_t signature[OTA_SIGNATURE_MAX];
+  size_t length = 0;
+  if (code == HTTP_CODE_OK && http.getSize() > 0 &&
+      http.getSize() <= OTA_SIGNATURE_MAX)
+    length = http.getStreamPtr()->readBytes(signature, http.getSize());
+  http.end();
+  if (length == 0) {
+    log(LOG_ERROR, "OTA: no signature at %s (%d)", sig_url.c_str(), code);
+    return false;
+  }
+  mbedtls_ecdsa_context ecdsa;
+  mbedtls_ecdsa_init(&ecdsa);
+  bool valid =
+      mbedtls_ecp_group_load(&ecdsa.grp, MBEDTLS_ECP_DP_SECP256R1) == 0 &&
+      mbedtls_ecp_point_read_binary(&ecdsa.grp, &ecdsa.Q, key, sizeof(key)) ==
+          0 &&
+      mbedtls_ecdsa_read_signature(&ecdsa, digest, 32, signature, length) ==
+          0;
+  mbedtls_ecdsa_free(&ecdsa);
+  if (!valid)
+    log(LOG_ERROR, "OTA: signature check failed");
+  return valid;
+}
+
+static bool download(const char *url) {
+  WiFiClient client;
+  HTTPClient http;
+  http.setTimeout(10000);
+  if (!http.begin(client, url)) {
+    log(LOG_ERROR, "OTA: unsupported URL %s", url);
+    return false;
+  }
+  int code = http.GET();
+  if (code != HTTP_CODE_OK) {
+    log(LOG_ERROR, "OTA: download failed (%d)", code);
+    http.end();
+    return false;
+  }
+  // A chunked body would feed its framing to the digest and the image
+  int remaining = http.getSize();
+  if (remaining <= 0) {
+    log(LOG_ERROR, "OTA: server sent no Content-Length");
+    http.end();
+    return false;
+  }
+  // Digest of the file as served, the signature covers it
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+  WiFiClient *stream = http.getStreamPtr();
+  uint8_t *chunk = (uint8_t *)malloc(OTA_CHUNK_SIZE);
+  GzipWriter *gzip = nullptr;
+  bool ok = chunk != nullptr;
+  bool started = false;
+  size_t received = 0;
+  unsigned long last_data = millis();
+  while (ok && remaining > 0) {
+    // Bytes already buffered are read even after the server closed
+    size_t available = stream->available();
+    if (available == 0) {
+      if (!http.connected())
+        break;
+      if (millis() - last_data > 10000) {
+        log(LOG_ERROR, "OTA: download stalled");
+        ok = false;
+      }
+      vTaskDelay(pdMS_TO_TICKS(5));
+      continue;
+    }
+    size_t want = min(min(available, (size_t)OTA_CHUNK_SIZE),
+                      (size_t)remaining);
+    size_t length = stream->readBytes(chunk, want);
+    last_data = millis();
+    mbedtls_sha256_update_ret(&sha, chunk, length);
+    if (!started) {
+      // Compressed images inflate to an unknown size
+      bool compressed =
+          length >= 2 && (chunk[0] | chunk[1] << 8) == GZIP_MAGIC;
+      if (compressed) {
+        gzip = new GzipWriter();
+        ok = gzip->valid();
+      }
+      ok = ok && Update.begin(compressed ? UPDATE_SIZE_UNKNOWN : remaining);
+      started = true;
+      log(LOG_INFO, "OTA: downloading %s image",
+          compressed ? "compressed" : "raw");
+    }
+    if (ok)
+      ok = gzip ? gzip->write(chunk, length)
+                : Update.write(chunk, length) == length;
+    received += length;
+    remaining -= length;
+  }
+  http.end();
+  free(chunk);
+  uint8_t digest[32];
+  mbedtls_sha256_finish_ret(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  bool complete = ok && started && (!gzip || gzip->finished()) &&
+                  remaining <= 0;
+  delete gzip;
+  if (!complete) {
+    log(LOG_ERROR, "OTA: failed after %u bytes: %s", (unsigned)received,
+        Update.hasError() ? Update.errorString() : "incomplete download");
+    if (started)
+      Update.abort();
+    return false;
+  }
+  // Nothing boots from the partition until Update.end()
+  if (!verifySignature(url, digest)) {
+    Update.abort();
+    return false;
+  }
+  // Validates the image before switching the boot partition
+  if (!Update.end(true)) {
+    log(LOG_ERROR, "OTA: image rejected: %s", Update.errorString());
+    return false;
+  }
+  log(LOG_INFO, "OTA: %u bytes written", (unsigned)received);
+  return true;
+}
+
+static void otaTask(void *parameter) {
+  if (!wifiConnected()) {
+    log(LOG_ERROR, "OTA: WiFi not connected");
+  } else if (pending) {
+    log(LOG_ERROR, "OTA: running image not confirmed yet");
+  } else if (strlen(OTA_PUBLIC_KEY) == 0) {
+    log(LOG_ERROR, "OTA: no signing key built in, updates disabled");
+  } else if (download(ota_url)) {
+    // Put the new image on probation, the running one is the fallback
+    Preferences preferences;
+    preferences.begin("ota", false);
+    preferences.putString("previous", esp_ota_get_running_partition()->label);
+    preferences.putUChar("boots", 0);
+    preferences.putBool("pending", true);
+    preferences.end();
+    log(LOG_INFO, "OTA: rebooting into the new image");
+    delay(500);
+    esp_restart();
+  }
+  running = false;
+  vTaskDelete(NULL);
+}
+
+bool startOta(const char *url) {
+  if (running)
+    return false;
+  running = true;
+  strlcpy(ota_url, url, sizeof(ota_url));
+  xTaskCreatePinnedToCore(otaTask,       // Task function
+                          "Ota",         // Task name
+                          STACK_OTA,     // Stack size (bytes)
+                          NULL,          // Parameter
+                          PRIORITY_OTA,  // Priority
+                          NULL,          // Task handle
+                          CORE_NETWORK   // Core
+  );
+  return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// Over-the-air updates. Images are streamed from an http:// URL straight into
+// the inactive app partition, gzip-compressed images are inflated on the fly.
+// A new image stays on probation until its first server heartbeat and is
+// rolled back if it reboots or stays silent before that.
+//
+// Images must be signed, <url>.sig holds the DER ECDSA P-256 signature over
+// the SHA-256 of the file as served (compressed or not). The public key is
+// built in, as the hex uncompressed point (65 bytes, 04 || X || Y):
+//
+//   build_flags = -D OTA_PUBLIC_KEY=\"04...\"
+//
+// Without it every update is refused.
+#ifndef OTA_PUBLIC_KEY
+#define OTA_PUBLIC_KEY ""
+#endif
+#define OTA_CHUNK_SIZE 4096
+// A P-256 DER signature is at most 72 bytes
+#define OTA_SIGNATURE_MAX 80
+// Boots allowed on probation before rolling back
+#define OTA_MAX_BOOTS 3
+// Time a new image has to reach the server
+#define OTA_CONFIRM_TIMEOUT_MS (5 * 60 * 1000)
+
+// Check the probation state, call once at boot after config.load()
+void beginOta();
+
+// Start an update in the background, returns false if one is running
+bool startOta(const char *url);
+
+// Notify that a server heartbeat arrived, confirms an image on probation
+void otaHeartbeat();
+
+// True while the running image is on probation
+bool otaPending();
@@ -0,0 +1,129 @@
+#include "perf.h"
+#include "global.h"
+
+#include <atomic>
+#include <cmath>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+struct Histogram {
+  uint32_t buckets[PERF_BUCKETS] = {};
+  uint32_t count = 0;
+  uint64_t total_us = 0;
+  uint32_t max_us = 0;
+  uint32_t last_us = 0;
+};
+
+static Histogram histograms[PERF_PROBES];
+static std::atomic<uint32_t> counters[PERF_COUNTERS];
+static portMUX_TYPE perf_lock = portMUX_INITIALIZER_UNLOCKED;
+// Last telemetry round trip over any transport
+static uint32_t last_round_trip_us = 0;
+
+static const char *probe_names[PERF_PROBES] = {
+    "sensor read", "http post", "push reply", "udp ack",
+    "relay",       "wifi join", "led show"};
+static const char *counter_names[PERF_COUNTERS] = {"heartbeat failures",
+                                                   "reconnects"};
+
+void perfRecord(PerfProbe probe, uint32_t us) {
+  uint8_t bucket = 0;
+  while (bucket < PERF_BUCKETS - 1 &&
+         us >= (1UL << (bucket + PERF_BUCKET_SHIFT)))
+    bucket++;
+  portENTER_CRITICAL_SAFE(&perf_lock);
+  Histogram &h = histograms[probe];
+  h.buckets[bucket]++;
+  h.count++;
+  h.total_us += us;
+  h.last_us = us;
+  if (us > h.max_us)
+    h.max_us = us;
+  if (probe >= PERF_HTTP_POST && probe <= PERF_RELAY)
+    last_round_trip_us = us;
+  portEXIT_CRITICAL_SAFE(&perf_lock);
+}
+
+void perfCount(PerfCounter counter) { counters[counter]++; }
+
+PerfSnapshot perfSnapshot() {
+  PerfSnapshot snapshot;
+  snapshot.heap_free_kb =
+      min(heap_caps_get_free_size(MALLOC_CAP_8BIT) / 1024, (size_t)UINT16_MAX);
+  snapshot.heartbeat_failures = counters[PERF_HEARTBEAT_FAILURES];
+  snapshot.reconnects = counters[PERF_RECONNECTS];
+  portENTER_CRITICAL(&perf_lock);
+  snapshot.post_ms =
+      min(last_round_trip_us / 1000, (uint32_t)UINT16_MAX);
+  portEXIT_CRITICAL(&perf_lock);
+  return snapshot;
+}
+
+// Upper bound (us) of the bucket holding the given fraction of samples
+static uint32_t percentile(const Histogram &h, float fraction) {
+  uint32_t target = ceilf(h.count * fraction), seen = 0;
+  for (uint8_t i = 0; i < PERF_BUCKETS; i++) {
+    seen += h.buckets[i];
+    if (seen >= target)
+      return i == PERF_BUCKETS - 1 ? h.max_us : 1UL << (i + PERF_BUCKET_SHIFT);
+  }
+  return h.max_us;
+}
+
+static void printTasks() {
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+  // Per-task CPU share since boot
+  static TaskStatus_t tasks[24];
+  uint32_t total = 0;
+  UBaseType_t n = uxTaskGetSystemState(tasks, 24, &total);
+  Serial.println("Task          Stack free  CPU");
+  for (UBaseType_t i = 0; i < n; i++)
+    Serial.printf("  %-12s %6u B  %5.1f%%\n", tasks[i].pcTaskName,
+                  (unsigned)tasks[i].usStackHighWaterMark,
+                  total ? tasks[i].ulRunTimeCounter * 100.0f / total : 0.0f);
+#else
+  // CPU share needs configGENERATE_RUN_TIME_STATS, stacks only for the
+  // tasks created by the firmware
+  static const char *task_names[] = {
+      "FanControl", "Sampler", "Led",        "Connection", "Telemetry",
+      "Resolver",   "Console", "ConsoleJob", "Ota"};
+  Serial.println("Task          Stack free");
+  for (const char *name : task_names) {
+    TaskHandle_t task = xTaskGetHandle(name);
+    if (task)
+      Serial.printf("  %-12s %6u B\n", name,
+                    (unsigned)uxTaskGetStackHighWaterMark(task));
+  }
+#endif
+}
+
+void printPerf() {
+  printTasks();
+  Serial.printf("Heap: %u B free, %u B min free, %u B largest block\n",
+                (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+  Serial.println("Latency         count     avg     p50     p95     max (us)");
+  for (uint8_t i = 0; i < PERF_PROBES; i++) {
+    Histogram h;
+    portENTER_CRITICAL(&perf_lock);
+    h = histograms[i];
+    portEXIT_CRITICAL(&perf_lock);
+    if (h.count == 0) {
+      Serial.printf("  %-12s %7u\n", probe_names[i], 0);
+      continue;
+    }
+    Serial.printf("  %-12s %7lu %7lu %7lu %7lu %7lu\n", probe_names[i],
+                  (unsigned long)h.count,
+                  (unsigned long)(h.total_us / h.count),
+                  (unsigned long)percentile(h, 0.5f),
+                  (unsigned long)percentile(h, 0.95f),
+                  (unsigned long)h.max_us);
+  }
+
+  for (uint8_t i = 0; i < PERF_COUNTERS; i++)
+    Serial.printf("%s: %lu\n", counter_names[i],
+                  (unsigned long)counters[i].load());
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <esp_timer.h>
+#include <stdint.h>
+
+// Lightweight latency probes and event counters, reported by the "perf"
+// console command and optionally sent with telemetry
+
+enum PerfProbe : uint8_t {
+  PERF_SENSOR_READ, // SHT3x reads, all sensors
+  PERF_HTTP_POST,   // Telemetry POST round trip
+  PERF_PUSH_REPLY,  // Push channel frame to its reply
+  PERF_UDP_ACK,     // UDP frame to its ack, retries included
+  PERF_RELAY,       // Leaf frame to the relay's reply
+  PERF_WIFI_JOIN,   // WiFi join, WiFi.begin() to GOT_IP
+  PERF_LED_SHOW,    // FastLED.show()
+  PERF_PROBES,
+};
+
+enum PerfCounter : uint8_t {
+  PERF_HEARTBEAT_FAILURES, // Frames the server did not acknowledge
+  PERF_RECONNECTS,         // WiFi links lost after being up
+  PERF_COUNTERS,
+};
+
+// Log2 buckets, bucket i holds latencies below 2^(i + PERF_BUCKET_SHIFT) us
+// (64 us .. 2 s, the last bucket also takes everything above)
+#define PERF_BUCKETS 16
+#define PERF_BUCKET_SHIFT 6
+
+// Subset of the stats sent with telemetry frames
+struct PerfSnapshot {
+  uint16_t heap_free_kb;
+  uint16_t heartbeat_failures;
+  uint16_t reconnects;
+  uint16_t post_ms; // Last telemetry round trip, whichever transport
+};
+
+void perfRecord(PerfProbe probe, uint32_t us);
+void perfCount(PerfCounter counter);
+PerfSnapshot perfSnapshot();
+
+// Print task, heap, latency and counter stats to Serial
+void printPerf();
+
+// Records the lifetime of the scope into a probe
+class PerfTimer {
+private:
+  PerfProbe probe;
+  int64_t started;
+
+public:
+  PerfTimer(PerfProbe probe) : probe(probe), started(esp_timer_get_time()) {}
+  ~PerfTimer() { perfRecord(probe, esp_timer_get_time() - started); }
+};
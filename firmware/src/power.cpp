@@ -0,0 +1,29 @@
+#include "power.h"
+#include "global.h"
+#include "relay.h"
+
+#include <WiFi.h>
+
+static bool low_power = false;
+static uint32_t full_cpu_mhz = 0;
+
+void updatePowerMode(bool idle) {
+  // Relays and leaves keep the modem awake for ESP-NOW
+  bool enable = idle && config.power_save && relayMode() == RELAY_OFF;
+  if (enable == low_power)
+    return;
+  low_power = enable;
+  if (full_cpu_mhz == 0)
+    full_cpu_mhz = getCpuFrequencyMhz();
+  if (enable) {
+    // Sleep the modem for WIFI_LISTEN_INTERVAL beacons instead of waking at
+    // every DTIM, the interval is set when joining
+    WiFi.setSleep(WIFI_PS_MAX_MODEM);
+    setCpuFrequencyMhz(POWER_IDLE_CPU_MHZ);
+  } else {
+    WiFi.setSleep(WIFI_PS_MIN_MODEM);
+    setCpuFrequencyMhz(full_cpu_mhz);
+  }
+}
+
+bool isLowPower() { return low_power; }
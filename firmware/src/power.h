@@ -0,0 +1,13 @@
+#pragma once
+
+// CPU clock while idling in low-power mode, the lowest that keeps WiFi up
+#define POWER_IDLE_CPU_MHZ 80
+// Beacon intervals the modem sleeps through in low-power mode, about 1 s at
+// the usual 102.4 ms beacon. Sent to the AP when joining, which buffers
+// frames for that long.
+#define WIFI_LISTEN_INTERVAL 10
+
+// Switch between full and low power, only takes effect while low-power mode
+// is enabled in config. Hardware is only touched on a change.
+void updatePowerMode(bool idle);
+bool isLowPower();
@@ -0,0 +1,72 @@
+#include "pwm.h"
+
+#include <esp_timer.h>
+
+bool FanPwm::supported(uint32_t freq, uint8_t bits) {
+  return freq > 0 && bits >= 1 && bits < LEDC_TIMER_BIT_MAX &&
+         (uint64_t)freq << bits <= FAN_PWM_CLOCK;
+}
+
+bool FanPwm::begin(uint8_t pin, uint32_t freq, uint8_t bits,
+                   ledc_channel_t channel) {
+  if (!supported(freq, bits))
+    return false;
+  ledc_timer_config_t timer_cfg = {};
+  timer_cfg.speed_mode = LEDC_LOW_SPEED_MODE;
+  timer_cfg.duty_resolution = (ledc_timer_bit_t)bits;
+  timer_cfg.timer_num = timer;
+  timer_cfg.freq_hz = freq;
+  timer_cfg.clk_cfg = LEDC_AUTO_CLK;
+  if (ledc_timer_config(&timer_cfg) != ESP_OK)
+    return false;
+  this->pin = pin;
+  this->channel = channel;
+  max_duty = 1UL << bits; // LEDC duty 2^bits is 100%
+  ledc_channel_config_t channel_cfg = {};
+  channel_cfg.gpio_num = pin;
+  channel_cfg.speed_mode = LEDC_LOW_SPEED_MODE;
+  channel_cfg.channel = channel;
+  channel_cfg.intr_type = LEDC_INTR_DISABLE;
+  channel_cfg.timer_sel = timer;
+  channel_cfg.duty = (uint32_t)(current * max_duty);
+  channel_cfg.hpoint = 0;
+  if (ledc_channel_config(&channel_cfg) != ESP_OK)
+    return false;
+  // Fade engine interrupt, shared by every channel
+  static bool fade_installed = false;
+  if (!fade_installed)
+    fade_installed = ledc_fade_func_install(0) == ESP_OK;
+  return true;
+}
+
+void FanPwm::write(float duty) {
+  current = duty;
+  // Straight to the channel registers, no pin/channel lookup
+  ledc_set_duty(LEDC_LOW_SPEED_MODE, channel, (uint32_t)(duty * max_duty));
+  ledc_update_duty(LEDC_LOW_SPEED_MODE, channel);
+}
+
+bool FanPwm::fading() const { return esp_timer_get_time() < fade_end; }
+
+bool FanPwm::fade(float duty, uint32_t ms) {
+  if (fading())
+    return false;
+  // The fade engine stops one step short of 2^bits
+  uint32_t target = min((uint32_t)(duty * max_duty), max_duty - 1);
+  if (ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, channel, target, ms) !=
+          ESP_OK ||
+      ledc_fade_start(LEDC_LOW_SPEED_MODE, channel, LEDC_FADE_NO_WAIT) !=
+          ESP_OK) {
+    write(duty);
+    return true;
+  }
+  current = duty;
+  fade_end = esp_timer_get_time() + ms * 1000LL;
+  return true;
+}
+
+float FanPwm::instant() const {
+  return max_duty ? (float)ledc_get_duty(LEDC_LOW_SPEED_MODE, channel) /
+                        max_duty
+                  : 0.0f;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+#include <driver/ledc.h>
+
+// Default fan PWM, 25 kHz per the 4-pin fan spec
+#define FAN_PWM_FREQ 25000
+#define FAN_PWM_BITS 10
+// LEDC source clock, frequency * 2^bits must not exceed it
+#define FAN_PWM_CLOCK 80000000UL
+// Default open loop ramp time for a full 0-100% duty swing, 0 steps instantly
+#define FAN_RAMP_MS 2000
+
+// LEDC-backed PWM output, every fan channel has its own LEDC channel on a
+// shared timer. Not thread safe, only the fan control task drives it.
+class FanPwm {
+private:
+  uint8_t pin = 0;
+  ledc_channel_t channel = LEDC_CHANNEL_0;
+  ledc_timer_t timer = LEDC_TIMER_0;
+  uint32_t max_duty = 0;
+  float current = 0.0f;
+  int64_t fade_end = 0; // esp_timer time the running fade completes
+
+public:
+  // Returns false if the frequency/resolution pair is not achievable
+  bool begin(uint8_t pin, uint32_t freq, uint8_t bits,
+             ledc_channel_t channel = LEDC_CHANNEL_0);
+  // Immediate duty change, waits for a running fade to complete
+  void write(float duty);
+  // Hardware fade to duty over ms without CPU involvement. Returns false,
+  // leaving the output alone, while the previous fade is still running.
+  bool fade(float duty, uint32_t ms);
+  bool fading() const;
+  // Target duty of the last write or fade
+  float read() const { return current; }
+  // Duty the LEDC is outputting right now, mid-fade included
+  float instant() const;
+  static bool supported(uint32_t freq, uint8_t bits);
+};
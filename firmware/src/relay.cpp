@@ -0,0 +1,248 @@
+#include "relay.h"
+#include "connection.h"
+#include "global.h"
+#include "led.h"
+#include "logger.h"
+
+#include <WiFi.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+#include <freertos/queue.h>
+#include <string.h>
+
+// Leaf probes for relays on every 2.4 GHz channel
+#define RELAY_CHANNELS 13
+
+static const uint8_t broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+// Reply (or offer) received by a leaf
+struct Downlink {
+  uint8_t relay[6];
+  uint8_t type;
+  uint8_t data[RELAY_PAYLOAD_MAX];
+  size_t length;
+};
+
+static RelayMode mode = RELAY_OFF;
+// Forward: frames from leaves, leaf: the latest downlink
+static QueueHandle_t uplinks = nullptr;
+static QueueHandle_t downlinks = nullptr;
+// Leaf: relay in use
+static uint8_t relay_mac[6] = {};
+static bool linked = false;
+static uint8_t misses = 0;
+// Leaf: frame waiting for its reply
+static bool in_flight = false;
+static TickType_t sent_at = 0;
+
+static bool addPeer(const uint8_t *mac) {
+  if (esp_now_is_peer_exist(mac))
+    return true;
+  esp_now_peer_info_t peer = {};
+  memcpy(peer.peer_addr, mac, sizeof(peer.peer_addr));
+  peer.channel = 0; // Whatever channel the radio is on
+  peer.ifidx = WIFI_IF_STA;
+  peer.encrypt = false;
+  esp_err_t err = esp_now_add_peer(&peer);
+  if (err == ESP_ERR_ESPNOW_FULL) {
+    // Evict one, a leaf still in range is re-added on its next frame
+    esp_now_peer_info_t old;
+    if (esp_now_fetch_peer(true, &old) == ESP_OK) {
+      esp_now_del_peer(old.peer_addr);
+      err = esp_now_add_peer(&peer);
+    }
+  }
+  return err == ESP_OK;
+}
+
+static bool sendPacket(const uint8_t *mac, uint8_t type, const char *path,
+                       const uint8_t *payload, size_t length) {
+  size_t path_length = path ? strlen(path) : 0;
+  if (path_length > RELAY_PATH_MAX || path_length + length > RELAY_PAYLOAD_MAX)
+    return false;
+  uint8_t packet[RELAY_HEADER_SIZE + RELAY_PAYLOAD_MAX];
+  uint16_t magic = RELAY_MAGIC;
+  memcpy(packet, &magic, sizeof(magic));
+  packet[2] = type;
+  packet[3] = path_length;
+  if (path_length)
+    memcpy(packet + RELAY_HEADER_SIZE, path, path_length);
+  if (length)
+    memcpy(packet + RELAY_HEADER_SIZE + path_length, payload, length);
+  return esp_now_send(mac, packet, RELAY_HEADER_SIZE + path_length + length) ==
+         ESP_OK;
+}
+
+// Runs in the WiFi task, only copies into the queues. Packets are handled
+// one at a time, so the staging buffers can be static.
+static void onReceive(const uint8_t *mac, const uint8_t *data, int length) {
+  uint16_t magic;
+  if (length < RELAY_HEADER_SIZE)
+    return;
+  memcpy(&magic, data, sizeof(magic));
+  uint8_t type = data[2];
+  uint8_t path_length = data[3];
+  if (magic != RELAY_MAGIC || path_length > RELAY_PATH_MAX ||
+      RELAY_HEADER_SIZE + path_length > length)
+    return;
+  const uint8_t *payload = data + RELAY_HEADER_SIZE + path_length;
+  size_t payload_length = length - RELAY_HEADER_SIZE - path_length;
+  if (mode == RELAY_FORWARD) {
+    // Discovery is answered right here, and only while the AP link is up
+    if (type == RELAY_PROBE && wifiConnected() && addPeer(mac)) {
+      sendPacket(mac, RELAY_OFFER, nullptr, nullptr, 0);
+    } else if (type == RELAY_UPLINK && path_length > 0) {
+      static RelayFrame frame;
+      memcpy(frame.leaf, mac, sizeof(frame.leaf));
+      memcpy(frame.path, data + RELAY_HEADER_SIZE, path_length);
+      frame.path[path_length] = '\0';
+      memcpy(frame.data, payload, payload_length);
+      frame.length = payload_length;
+      // A full queue drops the frame, the leaf buffers it and retries
+      xQueueSend(uplinks, &frame, 0);
+    }
+  } else if (mode == RELAY_LEAF &&
+             (type == RELAY_DOWNLINK || type == RELAY_OFFER)) {
+    static Downlink downlink;
+    memcpy(downlink.relay, mac, sizeof(downlink.relay));
+    downlink.type = type;
+    memcpy(downlink.data, payload, payload_length);
+    downlink.length = payload_length;
+    xQueueOverwrite(downlinks, &downlink);
+  }
+}
+
+void beginRelay() {
+  mode = config.relay_mode <= RELAY_LEAF ? (RelayMode)config.relay_mode
+                                         : RELAY_OFF;
+  if (mode == RELAY_OFF)
+    return;
+  // A sleeping modem misses ESP-NOW packets
+  WiFi.setSleep(WIFI_PS_NONE);
+  if (esp_now_init() != ESP_OK) {
+    log(LOG_ERROR, "ESP-NOW init failed, relay disabled");
+    mode = RELAY_OFF;
+    return;
+  }
+  if (mode == RELAY_FORWARD) {
+    uplinks = xQueueCreate(RELAY_QUEUE_DEPTH, sizeof(RelayFrame));
+  } else {
+    downlinks = xQueueCreate(1, sizeof(Downlink));
+    addPeer(broadcast);
+  }
+  esp_now_register_recv_cb(onReceive);
+  log(LOG_INFO, "ESP-NOW relay: %s",
+      mode == RELAY_FORWARD ? "forwarding for leaves" : "leaf");
+}
+
+RelayMode relayMode() { return mode; }
+
+static void setLinked(bool value) {
+  if (value == linked)
+    return;
+  linked = value;
+  misses = 0;
+  // No AP on a leaf, the relay link stands in for WiFi on the LED
+  ledSignal(LED_EVENT_WIFI, linked);
+}
+
+// Wait for a downlink of the given type, from the linked relay once linked.
+// A zero timeout only checks what is already queued.
+static bool awaitDownlink(Downlink &downlink, uint8_t type,
+                          uint32_t timeout_ms) {
+  TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeout_ms);
+  while (true) {
+    int32_t left = deadline - xTaskGetTickCount();
+    if (xQueueReceive(downlinks, &downlink, left > 0 ? left : 0) != pdTRUE)
+      return false;
+    if (downlink.type == type &&
+        (!linked || memcmp(downlink.relay, relay_mac, 6) == 0))
+      return true;
+  }
+}
+
+// Probe every channel until a relay offers to forward, the radio stays on
+// the channel it answered on
+static bool scan() {
+  static Downlink offer;
+  static uint32_t last_scan = 0;
+  if (last_scan != 0 && millis() - last_scan < RELAY_RESCAN_MS)
+    return false;
+  last_scan = millis();
+  for (uint8_t channel = 1; channel <= RELAY_CHANNELS; channel++) {
+    esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+    xQueueReset(downlinks);
+    if (!sendPacket(broadcast, RELAY_PROBE, nullptr, nullptr, 0) ||
+        !awaitDownlink(offer, RELAY_OFFER, RELAY_SCAN_DWELL_MS))
+      continue;
+    if (!addPeer(offer.relay))
+      continue;
+    memcpy(relay_mac, offer.relay, sizeof(relay_mac));
+    log(LOG_INFO, "Relay %02x:%02x:%02x:%02x:%02x:%02x on channel %u",
+        relay_mac[0], relay_mac[1], relay_mac[2], relay_mac[3], relay_mac[4],
+        relay_mac[5], channel);
+    setLinked(true);
+    return true;
+  }
+  return false;
+}
+
+// Leaf: count a frame without reply, give up on the relay after a few
+static void miss() {
+  if (++misses >= RELAY_MAX_MISSES) {
+    log(LOG_WARN, "Relay stopped answering, scanning again");
+    esp_now_del_peer(relay_mac);
+    setLinked(false);
+  }
+}
+
+bool relaySend(const char *path, const uint8_t *frame, size_t length) {
+  if (mode != RELAY_LEAF || in_flight || (!linked && !scan()))
+    return false;
+  xQueueReset(downlinks);
+  if (!sendPacket(relay_mac, RELAY_UPLINK, path, frame, length)) {
+    miss();
+    return false;
+  }
+  in_flight = true;
+  sent_at = xTaskGetTickCount();
+  return true;
+}
+
+bool relayPending() { return in_flight; }
+
+size_t relayReceive(uint8_t *reply, size_t cap, bool &lost) {
+  static Downlink downlink;
+  lost = false;
+  if (!in_flight)
+    return 0;
+  if (awaitDownlink(downlink, RELAY_DOWNLINK, 0)) {
+    in_flight = false;
+    misses = 0;
+    size_t n = min(downlink.length, cap);
+    memcpy(reply, downlink.data, n);
+    return n;
+  }
+  if (xTaskGetTickCount() - sent_at < pdMS_TO_TICKS(RELAY_REPLY_TIMEOUT_MS))
+    return 0;
+  in_flight = false;
+  lost = true;
+  miss();
+  return 0;
+}
+
+bool relayLinked() { return linked; }
+
+size_t relayFrameMax(const char *path) {
+  size_t path_length = strlen(path);
+  return path_length > RELAY_PATH_MAX ? 0 : RELAY_PAYLOAD_MAX - path_length;
+}
+
+bool nextRelayFrame(RelayFrame &frame) {
+  return uplinks && xQueueReceive(uplinks, &frame, 0) == pdTRUE;
+}
+
+bool relayReply(const uint8_t *leaf, const uint8_t *data, size_t length) {
+  return addPeer(leaf) &&
+         sendPacket(leaf, RELAY_DOWNLINK, nullptr, data, length);
+}
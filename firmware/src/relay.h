@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include "telemetry.h"
+
+// ESP-NOW relay for units at the edge of AP coverage. A leaf never joins
+// the AP, it sends its telemetry frames to a WiFi-connected unit in forward
+// mode, which uploads them to the server and returns the reply the same way.
+//
+// Packet, one ESP-NOW payload:
+//
+//   uint16_t magic RELAY_MAGIC
+//   uint8_t  type, RelayPacketType
+//   uint8_t  path length, 0 for downlink
+//   char     leaf telemetry URL path, not terminated
+//   payload  telemetry frame (uplink) or fan power reply (downlink)
+#define RELAY_MAGIC 0xAC5B
+#define RELAY_HEADER_SIZE 4
+#define RELAY_PATH_MAX 64
+// ESP-NOW payload limit minus the header
+#define RELAY_PAYLOAD_MAX (250 - RELAY_HEADER_SIZE)
+// Leaf: wait per channel while scanning for a relay, wait for a reply once
+// linked, and unanswered frames before scanning again. The reply wait
+// covers a forward that times out on both connect and response, a frame
+// given up on earlier may still reach the server and be resent in a batch.
+#define RELAY_SCAN_DWELL_MS 100
+#define RELAY_REPLY_TIMEOUT_MS                                                 \
+  (HTTP_CONNECT_TIMEOUT_MS + HTTP_RESPONSE_TIMEOUT_MS + 1000)
+#define RELAY_MAX_MISSES 3
+// Leaf: least time between channel scans while no relay answers
+#define RELAY_RESCAN_MS 10000
+// Forward: leaf frames held until the telemetry task uploads them, all
+// queued frames go to the server in one request to RELAY_BATCH_PATH
+#define RELAY_QUEUE_DEPTH 8
+#define RELAY_BATCH_PATH "/relay"
+
+// Relay role, applied at boot
+enum RelayMode : uint8_t {
+  RELAY_OFF = 0,
+  RELAY_FORWARD = 1, // WiFi-connected, forwards frames from leaves
+  RELAY_LEAF = 2,    // No AP association, telemetry goes through a relay
+};
+
+enum RelayPacketType : uint8_t {
+  RELAY_UPLINK = 1,   // Leaf to relay
+  RELAY_DOWNLINK = 2, // Relay to leaf
+  RELAY_PROBE = 3,    // Leaf broadcast while scanning, no payload
+  RELAY_OFFER = 4,    // Relay answer to a probe, no payload
+};
+
+// Frame received from a leaf, waiting to be forwarded
+struct RelayFrame {
+  uint8_t leaf[6];
+  char path[RELAY_PATH_MAX + 1];
+  uint8_t data[RELAY_PAYLOAD_MAX];
+  size_t length;
+};
+
+// Start ESP-NOW in the configured role, call once after WiFi.mode(WIFI_STA)
+void beginRelay();
+// Role as of boot
+RelayMode relayMode();
+
+// Leaf: send a frame without waiting for the reply, scanning the channels
+// for a relay first if none is known. One frame is in flight at a time,
+// returns false while one is or if no relay answers.
+bool relaySend(const char *path, const uint8_t *frame, size_t length);
+// Leaf: true while the last frame waits for its reply
+bool relayPending();
+// Leaf: reply to the frame in flight, 0 while none came. Never waits, gives
+// up on the frame after RELAY_REPLY_TIMEOUT_MS and sets lost.
+size_t relayReceive(uint8_t *reply, size_t cap, bool &lost);
+// Leaf: true while a relay answers
+bool relayLinked();
+// Leaf: largest frame relaySend() accepts for this path
+size_t relayFrameMax(const char *path);
+
+// Forward: next frame from a leaf, false if none is waiting
+bool nextRelayFrame(RelayFrame &frame);
+// Forward: return the server reply to a leaf
+bool relayReply(const uint8_t *leaf, const uint8_t *data, size_t length);
@@ -0,0 +1,105 @@
+#include "resolver.h"
+#include "connection.h"
+#include "logger.h"
+#include "tasks.h"
+
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <string.h>
+
+struct ResolverEntry {
+  char host[64] = "";
+  IPAddress ip;
+  bool valid = false;        // ip holds a resolved address
+  uint32_t next_refresh = 0; // millis() the next lookup is due
+  uint32_t used_at = 0;      // Last resolveCached(), for eviction
+};
+
+static ResolverEntry entries[RESOLVER_ENTRIES];
+static portMUX_TYPE entries_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t resolver_task = nullptr;
+
+static bool due(const ResolverEntry &entry, uint32_t now) {
+  return entry.host[0] && (int32_t)(now - entry.next_refresh) >= 0;
+}
+
+// Look up every due entry, the lock is not held while a lookup runs
+static void resolverTask(void *parameter) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    // Nothing to ask without a link, resolveCached() asks again later
+    if (!wifiConnected())
+      continue;
+    for (uint8_t i = 0; i < RESOLVER_ENTRIES; i++) {
+      char host[sizeof(entries[i].host)];
+      portENTER_CRITICAL(&entries_lock);
+      bool pending = due(entries[i], millis());
+      memcpy(host, entries[i].host, sizeof(host));
+      portEXIT_CRITICAL(&entries_lock);
+      if (!pending)
+        continue;
+      IPAddress ip;
+      bool ok = WiFi.hostByName(host, ip) == 1;
+      uint32_t now = millis();
+      portENTER_CRITICAL(&entries_lock);
+      // Skip the result if the entry was reused meanwhile
+      if (strcmp(entries[i].host, host) == 0) {
+        if (ok) {
+          entries[i].ip = ip;
+          entries[i].valid = true;
+        }
+        entries[i].next_refresh =
+            now + (ok ? RESOLVER_TTL_MS : RESOLVER_RETRY_MS);
+      }
+      portEXIT_CRITICAL(&entries_lock);
+      if (ok)
+        log(LOG_DEBUG, "Resolved %s to %s", host, ip.toString().c_str());
+      else
+        log(LOG_WARN, "DNS lookup for %s failed", host);
+    }
+  }
+}
+
+void beginResolver() {
+  xTaskCreatePinnedToCore(resolverTask,      // Task function
+                          "Resolver",        // Task name
+                          STACK_RESOLVER,    // Stack size (bytes)
+                          NULL,              // Parameter
+                          PRIORITY_RESOLVER, // Priority
+                          &resolver_task,    // Task handle
+                          CORE_NETWORK       // Core
+  );
+}
+
+bool resolveCached(const char *host, IPAddress &ip) {
+  if (ip.fromString(host))
+    return true;
+  if (strlen(host) >= sizeof(entries[0].host))
+    return false;
+  uint32_t now = millis();
+  portENTER_CRITICAL(&entries_lock);
+  ResolverEntry *entry = nullptr;
+  for (uint8_t i = 0; i < RESOLVER_ENTRIES && !entry; i++)
+    if (strcmp(entries[i].host, host) == 0)
+      entry = &entries[i];
+  if (!entry) {
+    // Evict the least recently used entry
+    entry = &entries[0];
+    for (uint8_t i = 1; i < RESOLVER_ENTRIES; i++)
+      if (now - entries[i].used_at > now - entry->used_at)
+        entry = &entries[i];
+    strcpy(entry->host, host);
+    entry->valid = false;
+    entry->next_refresh = now;
+  }
+  entry->used_at = now;
+  bool found = entry->valid;
+  if (found)
+    ip = entry->ip;
+  bool lookup = due(*entry, now);
+  portEXIT_CRITICAL(&entries_lock);
+  if (lookup && resolver_task)
+    xTaskNotifyGive(resolver_task);
+  return found;
+}
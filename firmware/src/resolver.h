@@ -0,0 +1,20 @@
+#pragma once
+
+#include <IPAddress.h>
+
+// Hostname cache for the telemetry endpoint. Lookups happen on a background
+// task, so callers never wait on DNS and a dead resolver only delays
+// picking up a changed address.
+#define RESOLVER_ENTRIES 4
+// Cached addresses are refreshed after this long, lwIP does not report the
+// record TTL through the Arduino API
+#define RESOLVER_TTL_MS 300000
+// Retry interval after a failed lookup, the previous address stays in use
+#define RESOLVER_RETRY_MS 10000
+
+// Start the lookup task, call once in setup()
+void beginResolver();
+
+// Cached address of host, IP literals are parsed in place. Never blocks: a
+// miss or an expired entry schedules a lookup, a miss returns false.
+bool resolveCached(const char *host, IPAddress &ip);
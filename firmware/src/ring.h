@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+
+// Fixed-capacity FIFO that overwrites the oldest item when full. Not thread
+// safe, owned by a single task.
+template <typename T, size_t N> class RingBuffer {
+private:
+  T items[N];
+  size_t head = 0; // Oldest item
+  size_t count = 0;
+
+public:
+  // Returns false if the oldest item had to be dropped
+  bool push(const T &item) {
+    items[(head + count) % N] = item;
+    if (count < N) {
+      count++;
+      return true;
+    }
+    head = (head + 1) % N;
+    return false;
+  }
+
+  // i-th oldest item
+  const T &peek(size_t i) const { return items[(head + i) % N]; }
+
+  // Remove the n oldest items
+  void drop(size_t n) {
+    if (n > count)
+      n = count;
+    head = (head + n) % N;
+    count -= n;
+  }
+
+  void clear() { head = count = 0; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  static constexpr size_t capacity() { return N; }
+};
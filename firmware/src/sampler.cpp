@@ -0,0 +1,64 @@
+#include "sampler.h"
+#include "fan.h"
+#include "global.h"
+#include "perf.h"
+#include "sensors.h"
+
+#include <cmath>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Status update implementation. In high repeatability mode this collects the
+// conversions requested on the previous call and immediately starts the next
+// ones, so the ~15 ms conversion overlaps the sampling period instead of
+// blocking. All sensors are triggered together and convert in parallel.
+Status &Status::update(bool low_repeatability) {
+  if (low_repeatability) {
+    // Single shot low repeatability reads, ~4 ms conversion each
+    PerfTimer timer(PERF_SENSOR_READ);
+    readSensors(sensors);
+  } else if (!sensorsRequested()) {
+    // Nothing converting, first sample or just switched from low
+    // repeatability. Keep the previous readings for this one.
+    requestSensors();
+  } else if (!sensorsReady()) {
+    // Sampling faster than conversion, keep the previous readings
+  } else {
+    PerfTimer timer(PERF_SENSOR_READ);
+    collectSensors(sensors);
+    requestSensors();
+  }
+  sensor_count = sensorCount();
+  temperature = sensors[0].temperature;
+  humidity = sensors[0].humidity;
+  fan_count = fanChannels();
+  flags = 0;
+  for (uint8_t i = 0; i < fan_count; i++) {
+    fans[i].rpm = fan_pulse_counters[i].rpm();
+    fans[i].power = getFanPower(i);
+    // Any stalled channel flags the unit
+    if (fans[i].power > 0.0f && fan_pulse_counters[i].stalled())
+      flags |= FLAG_FAN_STALLED;
+  }
+  fan_rpm = fans[0].rpm;
+  fan_power = fans[0].power;
+  if (!std::isnan(getFanTargetRpm()))
+    flags |= FLAG_CLOSED_LOOP;
+  sampled_at = millis();
+  return *this;
+}
+
+void samplerTask(void *parameter) {
+  Config local;
+  Status sample;
+  // Start the first conversions so the first sample has data
+  requestSensors();
+  TickType_t last_wake = xTaskGetTickCount();
+  while (true) {
+    config.refresh(local);
+    vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(local.sample_interval));
+    // Fixed rate, independent of how long telemetry takes
+    status.write(sample.update(local.sensor_low_repeatability));
+  }
+}
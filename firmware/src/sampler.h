@@ -0,0 +1,4 @@
+#pragma once
+
+// Sensor sampling task function, publishes into the global status snapshot
+void samplerTask(void *parameter);
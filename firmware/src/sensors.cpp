@@ -0,0 +1,90 @@
+#include "sensors.h"
+#include "logger.h"
+
+#include <SHT31.h>
+#include <Wire.h>
+
+static const uint8_t addresses[] = SENSOR_ADDRESSES;
+static_assert(sizeof(addresses) <= MAX_SENSORS, "Too many sensor addresses");
+
+// Drivers of the sensors found at boot, allocated once
+static SHT31 *sensors[MAX_SENSORS] = {};
+static uint8_t found[MAX_SENSORS] = {};
+static uint8_t count = 0;
+// Set per sensor while a requested conversion is running
+static bool pending[MAX_SENSORS] = {};
+// A request round is out, even if every sensor failed to start it
+static bool requested = false;
+
+// Address probe, an ACK means something is listening
+static bool probe(uint8_t address) {
+  Wire.beginTransmission(address);
+  return Wire.endTransmission() == 0;
+}
+
+uint8_t beginSensors() {
+  Wire.setClock(SENSOR_I2C_CLOCK);
+  for (uint8_t address : addresses) {
+    if (!probe(address))
+      continue;
+    SHT31 *sensor = new SHT31(address, &Wire);
+    if (!sensor->begin()) {
+      log(LOG_WARN, "SHT3x at 0x%02x did not respond to reset", address);
+      delete sensor;
+      continue;
+    }
+    found[count] = address;
+    sensors[count++] = sensor;
+    log(LOG_INFO, "SHT3x found at 0x%02x", address);
+  }
+  if (count == 0)
+    log(LOG_ERROR, "No SHT3x sensor found");
+  return count;
+}
+
+uint8_t sensorCount() { return count; }
+
+uint8_t sensorAddress(uint8_t index) {
+  return index < count ? found[index] : 0;
+}
+
+void readSensors(SensorReading *readings) {
+  for (uint8_t i = 0; i < count; i++) {
+    pending[i] = false;
+    if (sensors[i]->read(true)) {
+      readings[i].temperature = sensors[i]->getTemperature();
+      readings[i].humidity = sensors[i]->getHumidity();
+    } else {
+      readings[i] = SensorReading();
+    }
+  }
+  requested = false;
+}
+
+void requestSensors() {
+  for (uint8_t i = 0; i < count; i++)
+    pending[i] = sensors[i]->requestData();
+  requested = true;
+}
+
+bool sensorsRequested() { return requested; }
+
+bool sensorsReady() {
+  for (uint8_t i = 0; i < count; i++)
+    if (pending[i] && !sensors[i]->dataReady())
+      return false;
+  return true;
+}
+
+void collectSensors(SensorReading *readings) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (pending[i] && sensors[i]->readData(false)) {
+      readings[i].temperature = sensors[i]->getTemperature();
+      readings[i].humidity = sensors[i]->getHumidity();
+    } else {
+      readings[i] = SensorReading();
+    }
+    pending[i] = false;
+  }
+  requested = false;
+}
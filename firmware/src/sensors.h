@@ -0,0 +1,35 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+// SHT3x addresses probed at boot, ADDR pin low and high
+#define SENSOR_ADDRESSES {0x44, 0x45}
+#define MAX_SENSORS 2
+// Fast mode I2C, the SHT3x accepts up to 1 MHz
+#define SENSOR_I2C_CLOCK 400000
+
+struct SensorReading {
+  float temperature = NAN;
+  float humidity = NAN;
+};
+
+// Scan the bus and begin every SHT3x that answers, returns the count.
+// Call after Wire.begin().
+uint8_t beginSensors();
+// Sensors found at boot, ordered by address
+uint8_t sensorCount();
+uint8_t sensorAddress(uint8_t index);
+
+// Single shot low repeatability read of every sensor, ~4 ms each
+void readSensors(SensorReading *readings);
+// Start a high repeatability conversion on every sensor back to back, so
+// all of them convert in the same ~15 ms window
+void requestSensors();
+// True once every requested conversion has finished
+bool sensorsReady();
+// True from requestSensors() until the round is collected, or read over by
+// readSensors()
+bool sensorsRequested();
+// Collect the conversions started by requestSensors(), NaN where missing
+void collectSensors(SensorReading *readings);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Single writer, multiple reader sequence lock. Readers never block the
+// writer, they retry if a write happened while they were copying.
+template <typename T> class Seqlock {
+private:
+  std::atomic<uint32_t> seq{0};
+  T value;
+
+public:
+  // Must only be called from one task
+  void write(const T &v) {
+    uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed); // Odd: write in progress
+    std::atomic_thread_fence(std::memory_order_release);
+    value = v;
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  T read() const {
+    T copy;
+    uint32_t before, after;
+    do {
+      before = seq.load(std::memory_order_acquire);
+      copy = value;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return copy;
+  }
+
+  // Number of completed writes
+  uint32_t version() const {
+    return seq.load(std::memory_order_acquire) / 2;
+  }
+};
@@ -0,0 +1,162 @@
+#include "tach.h"
+
+// 2 pulses per revolution
+static inline float pulsesToRpm(uint32_t pulses, float seconds) {
+  return seconds > 0.0f ? 60.0f * ((float)pulses / seconds) / 2.0f : 0.0f;
+}
+
+void IRAM_ATTR FanPulseCounter::onEdge(void *arg) {
+  static_cast<FanPulseCounter *>(arg)->count.fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+// Integer only, the FPU must not be used from an ISR
+void IRAM_ATTR FanPulseCounter::onEdgePeriod(void *arg) {
+  auto self = static_cast<FanPulseCounter *>(arg);
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL_ISR(&self->lock);
+  int64_t period = now - self->last_edge;
+  if (period < TACH_MIN_PERIOD_US) {
+    // Glitch, ignore the edge entirely
+    portEXIT_CRITICAL_ISR(&self->lock);
+    return;
+  }
+  self->last_edge = now;
+  if (period > TACH_STALL_US) {
+    // First edge after a stop, nothing to measure against yet
+    self->period_sum = 0;
+    self->period_head = 0;
+    self->period_count = 0;
+    self->ema_period = 0;
+    portEXIT_CRITICAL_ISR(&self->lock);
+    return;
+  }
+  // Replace the oldest period in the ring, keeping a running sum
+  uint32_t p = (uint32_t)period;
+  if (self->period_count == TACH_PERIODS)
+    self->period_sum -= self->periods[self->period_head];
+  else
+    self->period_count++;
+  self->periods[self->period_head] = p;
+  self->period_sum += p;
+  self->period_head = (self->period_head + 1) % TACH_PERIODS;
+  uint32_t mean = self->period_sum / self->period_count;
+  if (self->ema_period == 0)
+    self->ema_period = mean;
+  else
+    self->ema_period = (uint32_t)((int32_t)self->ema_period +
+                                  (((int32_t)mean - (int32_t)self->ema_period) >>
+                                   TACH_EMA_SHIFT));
+  portEXIT_CRITICAL_ISR(&self->lock);
+}
+
+void FanPulseCounter::onGate(void *arg) {
+  auto self = static_cast<FanPulseCounter *>(arg);
+  uint32_t pulses;
+  if (self->mode == TACH_PCNT) {
+    int16_t value = 0;
+    pcnt_get_counter_value(self->unit, &value);
+    pcnt_counter_clear(self->unit);
+    pulses = value;
+  } else {
+    pulses = self->count.exchange(0, std::memory_order_relaxed);
+  }
+  self->gated_rpm.store(pulsesToRpm(pulses, TACH_GATE_MS * 1e-3f),
+                        std::memory_order_relaxed);
+}
+
+void FanPulseCounter::startGate() {
+  gated_rpm.store(0.0f);
+  esp_timer_create_args_t args = {};
+  args.callback = onGate;
+  args.arg = this;
+  args.name = "tach_gate";
+  esp_timer_create(&args, &gate);
+  esp_timer_start_periodic(gate, TACH_GATE_MS * 1000ULL);
+}
+
+void FanPulseCounter::begin(uint8_t pin, TachMode mode, pcnt_unit_t unit) {
+  end();
+  this->pin = pin;
+  this->mode = mode;
+  this->unit = unit;
+  pinMode(pin, INPUT_PULLUP);
+  if (mode == TACH_PCNT) {
+    pcnt_config_t cfg = {};
+    cfg.pulse_gpio_num = pin;
+    cfg.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+    cfg.lctrl_mode = PCNT_MODE_KEEP;
+    cfg.hctrl_mode = PCNT_MODE_KEEP;
+    cfg.pos_mode = PCNT_COUNT_DIS; // Count falling edges only
+    cfg.neg_mode = PCNT_COUNT_INC;
+    cfg.counter_h_lim = INT16_MAX;
+    cfg.counter_l_lim = 0;
+    cfg.unit = unit;
+    cfg.channel = PCNT_CHANNEL_0;
+    pcnt_unit_config(&cfg);
+    // Reject tach line glitches in hardware
+    pcnt_set_filter_value(unit, TACH_FILTER_CYCLES);
+    pcnt_filter_enable(unit);
+    pcnt_counter_pause(unit);
+    pcnt_counter_clear(unit);
+    pcnt_counter_resume(unit);
+    startGate();
+  } else if (mode == TACH_PERIOD) {
+    portENTER_CRITICAL(&lock);
+    last_edge = 0;
+    period_sum = 0;
+    period_head = 0;
+    period_count = 0;
+    ema_period = 0;
+    portEXIT_CRITICAL(&lock);
+    attachInterruptArg(digitalPinToInterrupt(pin), onEdgePeriod, this,
+                       FALLING);
+  } else {
+    count.store(0);
+    attachInterruptArg(digitalPinToInterrupt(pin), onEdge, this, FALLING);
+    startGate();
+  }
+  running = true;
+}
+
+void FanPulseCounter::end() {
+  if (!running)
+    return;
+  running = false;
+  if (gate) {
+    esp_timer_stop(gate);
+    esp_timer_delete(gate);
+    gate = nullptr;
+  }
+  if (mode == TACH_PCNT)
+    pcnt_counter_pause(unit);
+  else
+    detachInterrupt(digitalPinToInterrupt(pin));
+}
+
+float FanPulseCounter::rpm() {
+  if (mode == TACH_PERIOD) {
+    portENTER_CRITICAL(&lock);
+    int64_t last = last_edge;
+    uint32_t period = ema_period;
+    portEXIT_CRITICAL(&lock);
+    int64_t since = esp_timer_get_time() - last;
+    if (period == 0 || since > TACH_STALL_US)
+      return 0.0f;
+    // Decay towards zero while edges stop arriving
+    if (since > period)
+      period = (uint32_t)since;
+    return pulsesToRpm(1, period * 1e-6f);
+  }
+  return gated_rpm.load(std::memory_order_relaxed);
+}
+
+bool FanPulseCounter::stalled() {
+  if (mode == TACH_PERIOD) {
+    portENTER_CRITICAL(&lock);
+    int64_t last = last_edge;
+    portEXIT_CRITICAL(&lock);
+    return esp_timer_get_time() - last > TACH_STALL_US;
+  }
+  return gated_rpm.load(std::memory_order_relaxed) == 0.0f;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include <driver/pcnt.h>
+#include <esp_timer.h>
+
+// Gate interval of the hardware pulse counter
+#define TACH_GATE_MS 1000
+// PCNT glitch filter threshold in APB clock cycles (1023 = 12.8 us)
+#define TACH_FILTER_CYCLES 1023
+// Period mode: number of inter-pulse periods averaged, and EMA weight 2^-N
+// applied on top of the average
+#define TACH_PERIODS 8
+#define TACH_EMA_SHIFT 2
+// Period mode: shorter periods are rejected as glitches
+#define TACH_MIN_PERIOD_US 200
+// No edge for this long means the rotor is stopped or locked
+#define TACH_STALL_US 1000000
+
+// Tachometer modes
+enum TachMode : uint8_t {
+  TACH_ISR = 0,  // Count edges in a GPIO interrupt, latched by a gate timer
+  TACH_PCNT = 1, // Count edges in the PCNT peripheral, latched by a gate timer
+  TACH_PERIOD = 2, // Timestamp edges and average the inter-pulse periods
+};
+
+// FanPulseCounter class definition
+class FanPulseCounter {
+private:
+  TachMode mode = TACH_ISR;
+  uint8_t pin = 0;
+  pcnt_unit_t unit = PCNT_UNIT_0;
+  esp_timer_handle_t gate = nullptr;
+  bool running = false;
+  // ISR mode edge count
+  std::atomic<uint32_t> count{0};
+  // Counting modes, RPM latched at the end of each gate interval
+  std::atomic<float> gated_rpm{0.0f};
+  // Period mode state, shared with the edge ISR under lock
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  int64_t last_edge = 0;
+  uint32_t periods[TACH_PERIODS] = {};
+  uint32_t period_sum = 0;
+  uint8_t period_head = 0;
+  uint8_t period_count = 0;
+  uint32_t ema_period = 0; // Smoothed period in microseconds
+
+  static void IRAM_ATTR onEdge(void *arg);
+  static void IRAM_ATTR onEdgePeriod(void *arg);
+  static void onGate(void *arg);
+  void startGate();
+
+public:
+  // Every counter needs its own PCNT unit in TACH_PCNT mode
+  void begin(uint8_t pin, TachMode mode, pcnt_unit_t unit = PCNT_UNIT_0);
+  void end();
+  TachMode getMode() const { return mode; }
+  float rpm();
+  // True if no tach edge arrived within TACH_STALL_US
+  bool stalled();
+};
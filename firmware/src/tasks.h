@@ -0,0 +1,49 @@
+#pragma once
+
+// Task topology. The WiFi and lwIP tasks run on core 0, so network tasks
+// share that core and fan control, sensing and the LED get core 1 to
+// themselves.
+#define CORE_NETWORK 0
+#define CORE_CONTROL 1
+
+// Priorities, fan control preempts sensing, sensing preempts the LED, and
+// everything preempts console I/O. All stay below the WiFi stack.
+#define PRIORITY_FAN_CONTROL 5
+#define PRIORITY_SAMPLER 4
+#define PRIORITY_LED 3
+#define PRIORITY_CONNECTION 2
+#define PRIORITY_TELEMETRY 2
+#define PRIORITY_CONSOLE 1
+#define PRIORITY_CONSOLE_JOB 1
+#define PRIORITY_OTA 1
+#define PRIORITY_RESOLVER 1
+
+// Stack sizes (bytes), override with -D in build_flags. Check
+// uxTaskGetStackHighWaterMark() on the target before shrinking them.
+#ifndef STACK_FAN_CONTROL
+#define STACK_FAN_CONTROL 3072
+#endif
+#ifndef STACK_SAMPLER
+#define STACK_SAMPLER 3072
+#endif
+#ifndef STACK_LED
+#define STACK_LED 3072
+#endif
+#ifndef STACK_CONNECTION
+#define STACK_CONNECTION 4096
+#endif
+#ifndef STACK_TELEMETRY
+#define STACK_TELEMETRY 8192
+#endif
+#ifndef STACK_CONSOLE
+#define STACK_CONSOLE 4096
+#endif
+#ifndef STACK_CONSOLE_JOB
+#define STACK_CONSOLE_JOB 4096
+#endif
+#ifndef STACK_OTA
+#define STACK_OTA 6144
+#endif
+#ifndef STACK_RESOLVER
+#define STACK_RESOLVER 4096
+#endif
@@ -0,0 +1,730 @@
+#include "telemetry.h"
+#include "connection.h"
+#include "discovery.h"
+#include "fallback.h"
+#include "fan.h"
+#include "global.h"
+#include "led.h"
+#include "logger.h"
+#include "ota.h"
+#include "perf.h"
+#include "relay.h"
+#include "resolver.h"
+#include "ring.h"
+
+#include <ArduinoWebsockets.h>
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <cmath>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stddef.h>
+
+using namespace websockets;
+
+unsigned long last_heartbeat = 0;
+// Heartbeat interval currently in effect
+static volatile unsigned long heartbeat_interval = HTTP_POLL_INTERVAL_MS;
+static volatile bool udp_active = false;
+
+bool udpTelemetryActive() { return udp_active; }
+
+bool heartbeatFresh() {
+  return last_heartbeat != 0 &&
+         millis() - last_heartbeat <= heartbeat_interval + 2000;
+}
+
+// Apply a binary float fan power reply from the server, one float per fan
+// channel, optionally followed by a new fallback curve
+static bool applyFanPowerReply(const char *data, size_t length) {
+  size_t setpoints = fanChannels() * sizeof(float);
+  // A lone setpoint drives every channel, servers unaware of the channels
+  // reply with one
+  bool shared = length == sizeof(float);
+  if (shared)
+    setpoints = length;
+  if (length < setpoints)
+    return false;
+  for (uint8_t i = 0; i < fanChannels(); i++) {
+    float power;
+    memcpy(&power, data + (shared ? 0 : i * sizeof(float)), sizeof(power));
+    setFanPower(i, power);
+  }
+  last_heartbeat = millis();
+  otaHeartbeat();
+  if (length > setpoints &&
+      !applyFallbackCurve((const uint8_t *)data + setpoints,
+                          length - setpoints))
+    log(LOG_WARN, "Malformed fallback curve in reply");
+  return true;
+}
+
+// Forward server control and fault state to the LED when they change
+static void signalLed(const Status &sample) {
+  static bool controlled = false;
+  static uint8_t error = LED_ERROR_NONE;
+  bool fresh = heartbeatFresh();
+  if (fresh != controlled) {
+    controlled = fresh;
+    ledSignal(LED_EVENT_CONTROL, fresh);
+  }
+  uint8_t code = LED_ERROR_NONE;
+  if (sample.flags & FLAG_FAN_STALLED)
+    code = LED_ERROR_FAN_STALLED;
+  else if (sample.sampled_at != 0 && std::isnan(sample.temperature))
+    code = LED_ERROR_SENSOR;
+  if (code != error) {
+    error = code;
+    ledSignal(LED_EVENT_ERROR, code);
+  }
+}
+
+// Drive the fan from the cached curve while the server is silent, evaluated
+// once per fresh sample. Returns true while local control is active.
+static bool runFallback() {
+  static uint32_t last_sample = 0;
+  static bool active = false;
+  Status sample = status.read();
+  bool fallback = !heartbeatFresh() && fallbackRevision() != 0;
+  if (fallback != active) {
+    active = fallback;
+    log(active ? LOG_WARN : LOG_INFO, "%s",
+        active ? "Server silent, fan under local control"
+               : "Server control resumed");
+  }
+  if (active && sample.sampled_at != last_sample) {
+    last_sample = sample.sampled_at;
+    float power = fallbackPower(sample);
+    if (!std::isnan(power))
+      setFanPower(power);
+  }
+  return active;
+}
+
+// Server URL split into parts once, so heartbeats skip URL parsing
+struct ServerUrl {
+  String host = "";
+  uint16_t port = 80;
+  String path = "/";
+
+  // Accepts http://host[:port][/path], returns false for anything else
+  bool parse(const char *url) {
+    String s = url;
+    host = "";
+    if (!s.startsWith("http://"))
+      return false;
+    s = s.substring(7);
+    int slash = s.indexOf('/');
+    path = slash < 0 ? "/" : s.substring(slash);
+    String authority = slash < 0 ? s : s.substring(0, slash);
+    int colon = authority.indexOf(':');
+    port = colon < 0 ? 80 : authority.substring(colon + 1).toInt();
+    host = colon < 0 ? authority : authority.substring(0, colon);
+    if (port == 0)
+      host = "";
+    return valid();
+  }
+
+  bool valid() const { return host.length() > 0; }
+};
+
+// Long-lived HTTP/1.1 session, the TCP connection is kept open between
+// heartbeats and only re-established after an error or server close
+class TelemetrySession {
+private:
+  WiFiClient client;
+  HTTPClient http;
+
+public:
+  TelemetrySession() {
+    http.setReuse(true);
+    http.setConnectTimeout(HTTP_CONNECT_TIMEOUT_MS);
+    http.setTimeout(HTTP_RESPONSE_TIMEOUT_MS);
+  }
+
+  // Drop the connection, next post() reconnects
+  void close() { client.stop(); }
+
+  // POST a frame, returns HTTP code (negative on transport error)
+  int post(const ServerUrl &url, const uint8_t *data, size_t size,
+           String &response) {
+    if (!client.connected()) {
+      // Connect to the cached address, HTTPClient would resolve the host on
+      // every reconnect
+      IPAddress ip;
+      if (!resolveCached(url.host.c_str(), ip) ||
+          !client.connect(ip, url.port, HTTP_CONNECT_TIMEOUT_MS))
+        return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+    // begin() only stores the target, connect() reuses the open socket
+    if (!http.begin(client, url.host, url.port, url.path))
+      return HTTPC_ERROR_CONNECTION_REFUSED;
+    http.addHeader("Content-Type", "application/octet-stream");
+    int httpCode = http.POST(const_cast<uint8_t *>(data), size);
+    if (httpCode > 0)
+      response = http.getString();
+    http.end();
+    // Request failed midway, start over with a fresh connection
+    if (httpCode <= 0)
+      close();
+    return httpCode;
+  }
+
+  String errorToString(int httpCode) { return http.errorToString(httpCode); }
+};
+
+// WebSocket channel on the telemetry URL, the server replies to each status
+// frame and also pushes new fan power as soon as detections change
+class PushChannel {
+private:
+  WebsocketsClient client;
+  unsigned long last_attempt = 0;
+  bool open = false;
+  // esp_timer time of the last frame still waiting for its reply, 0 if none
+  int64_t sent_at = 0;
+
+public:
+  PushChannel() {
+    client.onMessage([this](WebsocketsMessage message) {
+      if (message.isBinary()) {
+        // Taken as the reply, a push landing first is counted instead
+        if (sent_at != 0)
+          perfRecord(PERF_PUSH_REPLY, esp_timer_get_time() - sent_at);
+        sent_at = 0;
+        applyFanPowerReply(message.rawData().data(), message.rawData().size());
+      } else if (message.data().startsWith("ota ")) {
+        // Update pushed by the server
+        startOta(message.data().c_str() + 4);
+      }
+    });
+  }
+
+  bool connected() { return open && client.available(); }
+
+  // Try to (re)open the channel, rate limited to one attempt per 5 seconds
+  void connect(const ServerUrl &url) {
+    unsigned long now = millis();
+    if (connected() || (last_attempt != 0 && now - last_attempt < 5000))
+      return;
+    last_attempt = now;
+    // Cached address, the library would block on DNS otherwise
+    IPAddress ip;
+    if (!resolveCached(url.host.c_str(), ip))
+      return;
+    open = client.connect(ip.toString(), url.port, url.path);
+    if (open)
+      log(LOG_INFO, "Push channel connected");
+  }
+
+  void close() {
+    if (open)
+      client.close();
+    open = false;
+  }
+
+  // Dispatch pending messages, returns false once the channel dropped
+  bool poll() {
+    if (!open)
+      return false;
+    client.poll();
+    if (!client.available()) {
+      log(LOG_WARN, "Push channel lost, falling back to HTTP");
+      open = false;
+    }
+    return open;
+  }
+
+  bool send(const uint8_t *data, size_t size) {
+    if (!open || !client.sendBinary((const char *)data, size))
+      return false;
+    sent_at = esp_timer_get_time();
+    return true;
+  }
+};
+
+// Datagram channel to the server host on the URL port, each frame is acked
+// with the setpoints, which the server may also push in between
+class UdpChannel {
+private:
+  WiFiUDP udp;
+  bool open = false;
+  bool enabled = false;
+  // Endpoint frames went to, the only source replies are taken from
+  IPAddress server_ip;
+  uint16_t server_port = 0;
+  // Frame waiting for its ack
+  bool pending = false;
+  uint32_t pending_seq = 0;
+  // Unacked frames in a row, and when the channel stood down for HTTP
+  uint8_t failures = 0;
+  bool standing_down = false;
+  unsigned long stood_down_at = 0;
+
+  // Handle one waiting datagram, returns false if there was none. Pushes
+  // and the ack of the pending frame are applied, stale acks and datagrams
+  // from anywhere but the server are dropped.
+  bool receive() {
+    // Setpoints and a full fallback curve fit
+    uint8_t reply[128];
+    if (udp.parsePacket() <= 0)
+      return false;
+    bool trusted = server_port != 0 && udp.remoteIP() == server_ip &&
+                   udp.remotePort() == server_port;
+    int n = trusted ? udp.read(reply, sizeof(reply)) : 0;
+    // Discard the rest, parsePacket() skips packets while data is left
+    udp.flush();
+    if (n < UDP_REPLY_HEADER_SIZE)
+      return true;
+    uint32_t seq;
+    memcpy(&seq, reply + 1, sizeof(seq));
+    bool acked = reply[0] == UDP_ACK && pending && seq == pending_seq;
+    if (acked || reply[0] == UDP_PUSH)
+      applyFanPowerReply((const char *)reply + UDP_REPLY_HEADER_SIZE,
+                         n - UDP_REPLY_HEADER_SIZE);
+    if (acked)
+      pending = false;
+    return true;
+  }
+
+public:
+  // Selected transport, takes effect on the next frame
+  void enable(bool value) {
+    enabled = value;
+    failures = 0;
+    standing_down = false;
+    if (!enabled)
+      close();
+  }
+
+  // True while frames should go out over UDP
+  bool active() {
+    if (standing_down && millis() - stood_down_at >= UDP_FALLBACK_MS) {
+      standing_down = false;
+      log(LOG_INFO, "Retrying UDP telemetry");
+    }
+    return enabled && !standing_down;
+  }
+
+  void close() {
+    if (open)
+      udp.stop();
+    open = false;
+  }
+
+  // Apply setpoints pushed since the last frame
+  void poll() {
+    for (int i = 0; open && i < 4 && receive(); i++)
+      ;
+  }
+
+  // Send a frame and wait for its ack, up to UDP_ATTEMPTS times. Returns
+  // false if none came, UDP_MAX_FAILURES such frames in a row stand the
+  // channel down for UDP_FALLBACK_MS.
+  bool send(const ServerUrl &url, const uint8_t *frame, size_t length) {
+    static uint8_t packet[1 + UDP_PATH_MAX + FRAME_BATCH_MAX_SIZE];
+    size_t path_length = url.path.length();
+    if (path_length > UDP_PATH_MAX || length < sizeof(FrameHeader) ||
+        length > FRAME_BATCH_MAX_SIZE)
+      return false;
+    // Address still being looked up, HTTP has the same problem
+    IPAddress ip;
+    if (!resolveCached(url.host.c_str(), ip))
+      return false;
+    if (!open)
+      // Any local port, replies come back to it
+      open = udp.begin(0);
+    if (!open)
+      return false;
+    server_ip = ip;
+    server_port = url.port;
+    packet[0] = path_length;
+    memcpy(packet + 1, url.path.c_str(), path_length);
+    memcpy(packet + 1 + path_length, frame, length);
+    size_t size = 1 + path_length + length;
+    memcpy(&pending_seq, frame + offsetof(FrameHeader, seq),
+           sizeof(pending_seq));
+    pending = true;
+    for (int attempt = 0; attempt < UDP_ATTEMPTS && pending; attempt++) {
+      if (!udp.beginPacket(ip, url.port) || udp.write(packet, size) != size ||
+          !udp.endPacket())
+        break;
+      TickType_t deadline =
+          xTaskGetTickCount() + pdMS_TO_TICKS(UDP_REPLY_TIMEOUT_MS);
+      while (pending && (int32_t)(deadline - xTaskGetTickCount()) > 0)
+        if (!receive())
+          vTaskDelay(1);
+    }
+    if (!pending) {
+      failures = 0;
+      return true;
+    }
+    pending = false;
+    if (++failures >= UDP_MAX_FAILURES) {
+      failures = 0;
+      standing_down = true;
+      stood_down_at = millis();
+      log(LOG_WARN, "Server not acking UDP frames, using HTTP for %d s",
+          UDP_FALLBACK_MS / 1000);
+    }
+    return false;
+  }
+};
+
+// Samples that could not be delivered, replayed in batches after an outage
+static RingBuffer<BatchRecord, BACKLOG_CAPACITY> backlog;
+
+// Send a frame as a datagram or over the push channel, or POST it when
+// neither gets through. Returns true once the server has the frame.
+static bool sendFrame(UdpChannel &udp, PushChannel &push,
+                      TelemetrySession &session, const ServerUrl &url,
+                      const uint8_t *frame, size_t length) {
+  if (udp.active()) {
+    int64_t started = esp_timer_get_time();
+    bool acked = udp.send(url, frame, length);
+    if (acked)
+      perfRecord(PERF_UDP_ACK, esp_timer_get_time() - started);
+    if (acked) {
+      session.close();
+      return true;
+    }
+    // No ack, the frame goes over HTTP instead
+  }
+  if (push.send(frame, length)) {
+    // Reply arrives through poll()
+    session.close();
+    return true;
+  }
+  String response;
+  int64_t started = esp_timer_get_time();
+  int httpCode = session.post(url, frame, length, response);
+  perfRecord(PERF_HTTP_POST, esp_timer_get_time() - started);
+  if (httpCode > 0) {
+    if (httpCode == HTTP_CODE_OK) {
+      // Parse binary float response for fan power
+      applyFanPowerReply(response.c_str(), response.length());
+      return true;
+    }
+    log(LOG_WARN, "Heartbeat response code: %d", httpCode);
+  } else {
+    log(LOG_WARN, "Heartbeat failed: %s",
+        session.errorToString(httpCode).c_str());
+  }
+  perfCount(PERF_HEARTBEAT_FAILURES);
+  return false;
+}
+
+static void bufferSample(const Status &sample) {
+  // Heartbeats may repeat a sample, keep each one once
+  if (!backlog.empty() &&
+      backlog.peek(backlog.size() - 1).uptime == sample.sampled_at)
+    return;
+  if (!backlog.push(batchRecord(sample)))
+    log(LOG_WARN, "Telemetry backlog full, dropping oldest samples");
+}
+
+// Upload buffered samples, several per request
+static void flushBacklog(UdpChannel &udp, PushChannel &push,
+                         TelemetrySession &session, const ServerUrl &url,
+                         uint32_t &seq) {
+  uint8_t batch_frame[FRAME_BATCH_MAX_SIZE];
+  for (int i = 0; i < BACKLOG_BATCHES_PER_TICK && !backlog.empty(); i++) {
+    BatchWriter batch(batch_frame, sizeof(batch_frame), seq++, millis());
+    size_t n = 0;
+    while (n < backlog.size() && batch.add(backlog.peek(n)))
+      n++;
+    if (!sendFrame(udp, push, session, url, batch_frame, batch.size()))
+      return;
+    backlog.drop(n);
+    if (backlog.empty())
+      log(LOG_INFO, "Telemetry backlog uploaded");
+  }
+}
+
+// Leaf mode, one frame through the relay at a time. The reply is collected
+// on later ticks, so fallback control and the LED keep running meanwhile.
+class LeafUplink {
+private:
+  Status sample;      // Status frame in flight, buffered if it is lost
+  size_t records = 0; // Batch frame in flight, backlog records it carries
+  int64_t sent_at = 0;
+  bool answered = false; // Last frame got a reply
+
+  bool send(const ServerUrl &url, const uint8_t *frame, size_t length) {
+    if (relaySend(url.path.c_str(), frame, length)) {
+      sent_at = esp_timer_get_time();
+      return true;
+    }
+    answered = false;
+    log(LOG_WARN, "Heartbeat failed: no relay in range");
+    perfCount(PERF_HEARTBEAT_FAILURES);
+    return false;
+  }
+
+public:
+  bool busy() const { return relayPending(); }
+
+  // Returns false if the frame could not go out
+  bool sendStatus(const ServerUrl &url, const uint8_t *frame, size_t length,
+                  const Status &status) {
+    if (!send(url, frame, length))
+      return false;
+    sample = status;
+    records = 0;
+    return true;
+  }
+
+  // Upload the next backlog batch while idle, once the relay answers again
+  void sendBacklog(const ServerUrl &url, uint32_t &seq) {
+    if (!answered || busy() || backlog.empty())
+      return;
+    // Batches must fit a single ESP-NOW packet
+    uint8_t batch_frame[FRAME_BATCH_MAX_SIZE];
+    size_t cap = min(sizeof(batch_frame), relayFrameMax(url.path.c_str()));
+    BatchWriter batch(batch_frame, cap, seq++, millis());
+    size_t n = 0;
+    while (n < backlog.size() && batch.add(backlog.peek(n)))
+      n++;
+    if (n > 0 && send(url, batch_frame, batch.size()))
+      records = n;
+  }
+
+  // Apply the reply to the frame in flight, if it came
+  void poll() {
+    uint8_t reply[RELAY_PAYLOAD_MAX];
+    bool lost;
+    size_t n = relayReceive(reply, sizeof(reply), lost);
+    if (n > 0 && applyFanPowerReply((const char *)reply, n)) {
+      perfRecord(PERF_RELAY, esp_timer_get_time() - sent_at);
+      answered = true;
+      backlog.drop(records);
+      if (records > 0 && backlog.empty())
+        log(LOG_INFO, "Telemetry backlog uploaded");
+      return;
+    }
+    if (n == 0 && !lost)
+      return;
+    answered = false;
+    log(LOG_WARN, "Heartbeat failed: %s",
+        lost ? "no reply from relay" : "malformed reply");
+    perfCount(PERF_HEARTBEAT_FAILURES);
+    // Batch records stay in the backlog until acknowledged
+    if (records == 0)
+      bufferSample(sample);
+  }
+};
+
+// Forward mode, upload the frames queued by leaves in one request and
+// return each reply to its leaf, see RELAY_BATCH_PATH
+static void forwardRelayFrames(TelemetrySession &session,
+                               const ServerUrl &url) {
+  static RelayFrame frames[RELAY_QUEUE_DEPTH];
+  // Per frame: path length, path, uint16 frame length, frame
+  static uint8_t body[RELAY_QUEUE_DEPTH *
+                      (3 + RELAY_PATH_MAX + RELAY_PAYLOAD_MAX)];
+  size_t count = 0, size = 0;
+  while (count < RELAY_QUEUE_DEPTH && nextRelayFrame(frames[count])) {
+    const RelayFrame &frame = frames[count++];
+    uint8_t path_length = strlen(frame.path);
+    uint16_t length = frame.length;
+    body[size++] = path_length;
+    memcpy(body + size, frame.path, path_length);
+    size += path_length;
+    memcpy(body + size, &length, sizeof(length));
+    size += sizeof(length);
+    memcpy(body + size, frame.data, length);
+    size += length;
+  }
+  if (count == 0)
+    return;
+  ServerUrl target = url;
+  target.path = RELAY_BATCH_PATH;
+  String response;
+  int httpCode = session.post(target, body, size, response);
+  if (httpCode != HTTP_CODE_OK) {
+    log(LOG_WARN, "Relay forward of %u frame(s) failed: %d", (unsigned)count,
+        httpCode);
+    return;
+  }
+  // Per frame in the same order: uint16 reply length, reply
+  const uint8_t *reply = (const uint8_t *)response.c_str();
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint16_t length;
+    if (offset + sizeof(length) > response.length())
+      break;
+    memcpy(&length, reply + offset, sizeof(length));
+    offset += sizeof(length);
+    if (offset + length > response.length())
+      break;
+    if (length > 0)
+      relayReply(frames[i].leaf, reply + offset, length);
+    offset += length;
+  }
+}
+
+// Report-on-change policy: a sample is due when a field moved past its
+// deadband, fan power or flags changed, or the heartbeat interval elapsed
+class ReportPolicy {
+private:
+  Status last;
+  unsigned long last_at = 0;
+  bool reported_once = false;
+
+  static bool moved(float a, float b, float deadband) {
+    if (std::isnan(a) || std::isnan(b))
+      return std::isnan(a) != std::isnan(b);
+    return fabsf(a - b) >= deadband;
+  }
+
+public:
+  bool due(const Status &sample, const Config &cfg, unsigned long heartbeat,
+           unsigned long now) const {
+    if (!reported_once || now - last_at >= heartbeat)
+      return true;
+    // Fast path, setpoint changes go out immediately
+    if (sample.flags != last.flags ||
+        moved(sample.fan_power, last.fan_power, 0.0001f))
+      return true;
+    // Additional fan channels, fans[0] mirrors fan_power and fan_rpm
+    for (uint8_t i = 1; i < sample.fan_count; i++)
+      if (moved(sample.fans[i].power, last.fans[i].power, 0.0001f) ||
+          moved(sample.fans[i].rpm, last.fans[i].rpm, cfg.deadband_rpm))
+        return true;
+    // Every sensor shares the deadbands, sensors[0] is the primary reading
+    for (uint8_t i = 0; i < sample.sensor_count; i++)
+      if (moved(sample.sensors[i].temperature, last.sensors[i].temperature,
+                cfg.deadband_temperature) ||
+          moved(sample.sensors[i].humidity, last.sensors[i].humidity,
+                cfg.deadband_humidity))
+        return true;
+    return moved(sample.temperature, last.temperature,
+                 cfg.deadband_temperature) ||
+           moved(sample.humidity, last.humidity, cfg.deadband_humidity) ||
+           moved(sample.fan_rpm, last.fan_rpm, cfg.deadband_rpm);
+  }
+
+  // Time until a report can next be due, on a fresh sample or the heartbeat
+  unsigned long idle(const Config &cfg, unsigned long heartbeat,
+                     unsigned long now) const {
+    unsigned long wait = cfg.sample_interval;
+    if (reported_once)
+      wait = min(wait, now - last_at < heartbeat ? heartbeat - (now - last_at)
+                                                 : 0UL);
+    // Never spin, the loop may skip the report while the URL is invalid
+    return max(wait, 20UL);
+  }
+
+  void reported(const Status &sample, unsigned long now) {
+    last = sample;
+    last_at = now;
+    reported_once = true;
+  }
+};
+
+void telemetryTask(void *parameter) {
+  TelemetrySession session;
+  // Leaf frames, kept apart so the push channel doesn't close it
+  TelemetrySession relay_session;
+  PushChannel push;
+  UdpChannel udp;
+  ReportPolicy policy;
+  Config local;
+  ServerUrl url;
+  uint32_t seq = 0;
+  uint8_t frame[FRAME_MAX_SIZE];
+  LeafUplink uplink;
+  bool leaf = relayMode() == RELAY_LEAF;
+  while (true) {
+    bool online;
+    // Pushed setpoints, relay frames and leaf replies are polled every 20 ms,
+    // otherwise the loop sleeps until a report can be due
+    bool polling = push.connected() || udp.active() ||
+                   relayMode() == RELAY_FORWARD ||
+                   (leaf && (uplink.busy() || !backlog.empty()));
+    TickType_t wait = pdMS_TO_TICKS(
+        polling ? 20 : policy.idle(local, heartbeat_interval, millis()));
+    if (leaf) {
+      // No AP to wait for, the relay reply tells if anyone listens
+      vTaskDelay(wait);
+      online = true;
+    } else if (wifiConnected()) {
+      vTaskDelay(wait);
+      online = wifiConnected();
+    } else {
+      // Block on the connected bit, waking once per sample to buffer it
+      online = waitForWiFi(pdMS_TO_TICKS(local.sample_interval));
+    }
+    // Pushed setpoints are applied from within poll()
+    if (online && !leaf) {
+      push.poll();
+      udp.poll();
+    }
+    if (config.refresh(local)) {
+      // Settings changed, reconnect in case the server URL moved
+      push.close();
+      session.close();
+      udp.close();
+      udp.enable(local.transport == TRANSPORT_UDP);
+      if (!url.parse(local.server) && strlen(local.server) > 0)
+        log(LOG_ERROR, "Unsupported server URL: %s", local.server);
+    }
+    if (online && !leaf)
+      pollDiscovery(local);
+    if (leaf)
+      uplink.poll();
+    bool local_control = runFallback();
+    signalLed(status.read());
+    if (!url.valid())
+      continue;
+    if (online && relayMode() == RELAY_FORWARD)
+      forwardRelayFrames(relay_session, url);
+    unsigned long now = millis();
+    // Latest snapshot from the sampler, never waits on the sensor
+    Status sample = status.read();
+    // Report the current setpoints, they may have changed since sampling
+    for (uint8_t i = 0; i < sample.fan_count; i++)
+      sample.fans[i].power = getFanPower(i);
+    sample.fan_power = getFanPower();
+    if (local_control)
+      sample.flags |= FLAG_LOCAL_CONTROL;
+    // Setpoints only arrive in HTTP replies while the push channel is down,
+    // a UDP server pushes them as datagrams
+    udp_active = !leaf && udp.active();
+    unsigned long heartbeat = local.report_heartbeat;
+    if (!push.connected() && !udp_active && heartbeat > HTTP_POLL_INTERVAL_MS)
+      heartbeat = HTTP_POLL_INTERVAL_MS;
+    heartbeat_interval = heartbeat;
+    if (!policy.due(sample, local, heartbeat, now)) {
+      // Leaves catch up on buffered samples between reports
+      if (leaf)
+        uplink.sendBacklog(url, seq);
+      continue;
+    }
+    policy.reported(sample, now);
+    if (!online) {
+      bufferSample(sample);
+      continue;
+    }
+    if (!leaf && !udp_active)
+      push.connect(url);
+    PerfSnapshot perf = perfSnapshot();
+    size_t length =
+        encodeStatus(sample, seq++, fallbackRevision(),
+                     local.perf_telemetry ? &perf : nullptr, frame,
+                     sizeof(frame));
+    if (leaf) {
+      // A sample due while a frame is in flight waits in the backlog
+      if (uplink.busy() || !uplink.sendStatus(url, frame, length, sample))
+        bufferSample(sample);
+      continue;
+    }
+    if (!sendFrame(udp, push, session, url, frame, length)) {
+      bufferSample(sample);
+      continue;
+    }
+    // Catch up on samples buffered during the outage
+    if (!backlog.empty())
+      flushBacklog(udp, push, session, url, seq);
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Samples kept in RAM while the server is unreachable (~8 minutes at 1 Hz),
+// as 16-byte BatchRecords
+#define BACKLOG_CAPACITY 512
+// Batch frames uploaded per heartbeat while catching up
+#define BACKLOG_BATCHES_PER_TICK 4
+// Telemetry HTTP session timeouts
+#define HTTP_CONNECT_TIMEOUT_MS 2000
+#define HTTP_RESPONSE_TIMEOUT_MS 2000
+// Heartbeat cap while the push channel is down, HTTP replies are then the
+// only way setpoints reach the unit
+#define HTTP_POLL_INTERVAL_MS 1000
+
+// UDP transport, one datagram per frame to the server host on the URL port.
+//
+//   request: uint8_t path length, telemetry URL path (not terminated), frame
+//   reply:   uint8_t type, UdpReplyType
+//            uint32_t seq of the acknowledged frame, 0 for a push
+//            fan power reply, as in the HTTP response body
+//
+// A frame is sent again with the same seq until its ack arrives, the server
+// may see it more than once.
+#define UDP_PATH_MAX 64
+#define UDP_REPLY_HEADER_SIZE 5
+// Wait per attempt, and attempts per frame
+#define UDP_REPLY_TIMEOUT_MS 250
+#define UDP_ATTEMPTS 3
+// Unacked frames in a row before reverting to HTTP, and for how long
+#define UDP_MAX_FAILURES 3
+#define UDP_FALLBACK_MS 60000
+
+enum TelemetryTransport : uint8_t {
+  TRANSPORT_HTTP = 0, // WebSocket push channel, POST while it is down
+  TRANSPORT_UDP = 1,  // Datagrams, HTTP only while the server does not ack
+};
+
+enum UdpReplyType : uint8_t {
+  UDP_ACK = 1,  // Reply to a frame
+  UDP_PUSH = 2, // Setpoint change pushed by the server
+};
+
+// Timestamp (millis) of the last successful heartbeat
+extern unsigned long last_heartbeat;
+
+// True while server replies arrive at least once per heartbeat interval
+bool heartbeatFresh();
+
+// True while telemetry goes out over UDP
+bool udpTelemetryActive();
+
+// Telemetry task function
+void telemetryTask(void *parameter);
@@ -1,8 +1,10 @@
 import express from "express";
 import os from "os";
 import fs from "fs";
+import dgram from "dgram";
 import path from "path";
 import { program } from "commander";
+import { WebSocketServer, WebSocket } from "ws";
 
 // Parse command line arguments
 program
@@ -24,6 +26,9 @@ const statusTimeout = parseFloat(options.statusTimeout) * 1000; // Convert to mi
 
 const app = express();
 const PORT = 3000;
+// Units listen for server announcements on this UDP port
+const DISCOVERY_PORT = 3001;
+const DISCOVERY_INTERVAL = 5000;
 
 function populationToFanPower(population: number) {
   // Preserve NaN
@@ -34,6 +39,43 @@ function populationToFanPower(population: number) {
   return clampedPopulation / maxPopulation;
 }
 
+// Per-channel multiplier on the fan power, for units with more than one fan.
+// Channel 0 is the first fan, channels beyond the list run at full scale.
+const FAN_CHANNEL_SCALE = [1.0, 1.0, 1.0];
+
+// Control curve pushed to units for use while the server is unreachable, the
+// unit can't see the population so the curve maps its own temperature to fan
+// power. Bump the revision after editing, units only download a revision they
+// don't have.
+const FALLBACK_CURVE = {
+  revision: 1,
+  // Minimum fan power at or above this relative humidity (%)
+  humidity_threshold: 70,
+  humidity_power: 0.3,
+  // [temperature °C, fan power], ascending temperature, at most 8 points
+  points: [
+    [24, 0.0],
+    [28, 0.5],
+    [32, 1.0],
+  ],
+};
+
+// Curve wire format, see firmware/src/fallback.h
+function fallbackCurveFrame() {
+  const { revision, humidity_threshold, humidity_power, points } =
+    FALLBACK_CURVE;
+  const buffer = Buffer.alloc(8 + points.length * 4);
+  buffer.writeUInt16LE(revision, 0);
+  buffer.writeUInt8(points.length, 2);
+  buffer.writeInt16LE(Math.round(humidity_threshold * 100), 4);
+  buffer.writeInt16LE(Math.round(humidity_power * 10000), 6);
+  points.forEach(([temperature, power], i) => {
+    buffer.writeInt16LE(Math.round(temperature * 100), 8 + i * 4);
+    buffer.writeInt16LE(Math.round(power * 10000), 10 + i * 4);
+  });
+  return buffer;
+}
+
 function getLocalIPs() {
   const interfaces = os.networkInterfaces();
   const ips = [];
@@ -49,6 +91,37 @@ function getLocalIPs() {
   return ips;
 }
 
+// Directed broadcast address of every external IPv4 interface
+function getBroadcastAddresses() {
+  const addresses = [];
+  for (const iface of Object.values(os.networkInterfaces())) {
+    for (const node of iface ?? []) {
+      if (node.internal || node.family !== "IPv4") continue;
+      const ip = node.address.split(".").map(Number);
+      const mask = node.netmask.split(".").map(Number);
+      addresses.push(ip.map((b, i) => (b | (~mask[i] & 0xff)) >>> 0).join("."));
+    }
+  }
+  return addresses;
+}
+
+// Announce the telemetry port, units with a discovery domain configure their
+// server URL from the sender address. Format: "SMARTAC <version> <port>".
+function startDiscovery() {
+  const socket = dgram.createSocket("udp4");
+  socket.on("error", (err) => console.error("Discovery socket error:", err));
+  socket.bind(() => {
+    socket.setBroadcast(true);
+    const message = Buffer.from(`SMARTAC 1 ${PORT}`);
+    const announce = () => {
+      for (const address of getBroadcastAddresses())
+        socket.send(message, DISCOVERY_PORT, address);
+    };
+    announce();
+    setInterval(announce, DISCOVERY_INTERVAL);
+  });
+}
+
 function ensureDir(folderPath: string) {
   if (!fs.existsSync(folderPath)) {
     fs.mkdirSync(folderPath, { recursive: true });
@@ -82,6 +155,12 @@ type Status = {
   temperature?: number;
   humidity?: number;
   fan_rpm?: number;
+  fan_stalled?: boolean;
+  local_control?: boolean;
+  // Every sensor of a unit with more than one, the first is the primary
+  sensors?: { temperature: number; humidity: number }[];
+  // Every fan channel of a unit with more than one, the first is channel 0
+  fans?: { rpm: number; power: number }[];
 };
 
 const status: Map<string, Status> = new Map();
@@ -102,6 +181,147 @@ function updateStatus(domain: string, s: Status) {
   );
 }
 
+// Push channel state, the last power pushed and the fan channels reported
+type Unit = { power: number; channels: number };
+
+// Open WebSocket push channels per domain
+const units: Map<string, Map<WebSocket, Unit>> = new Map();
+
+// Push fan power to every connected unit whose setpoint changed
+function pushFanPower() {
+  for (const [domain, sockets] of units) {
+    const power = populationToFanPower(domains[domain] ?? NaN);
+    for (const [ws, unit] of sockets) {
+      // Object.is() treats NaN as equal to NaN
+      if (Object.is(power, unit.power)) continue;
+      unit.power = power;
+      ws.send(fanPowerFrame(power, unit.channels));
+    }
+  }
+  for (const [domain, endpoints] of udpUnits) {
+    const power = populationToFanPower(domains[domain] ?? NaN);
+    for (const unit of endpoints.values()) {
+      if (Object.is(power, unit.power)) continue;
+      unit.power = power;
+      const frame = fanPowerFrame(power, unit.channels);
+      udpSocket.send(udpReply(UDP_PUSH, 0, frame), unit.port, unit.address);
+    }
+  }
+}
+
+function attachUnit(domain: string, ws: WebSocket) {
+  if (!units.has(domain)) units.set(domain, new Map());
+  const sockets = units.get(domain)!;
+  const unit: Unit = {
+    power: populationToFanPower(domains[domain] ?? NaN),
+    channels: 1,
+  };
+  sockets.set(ws, unit);
+  console.log(`Domain ${domain} | Push channel opened`);
+  ws.on("message", (data, isBinary) => {
+    const body = Buffer.isBuffer(data) ? data : Buffer.from(data as ArrayBuffer);
+    const reply = isBinary ? handleTelemetry(domain, body, unit) : null;
+    if (reply) {
+      unit.power = populationToFanPower(domains[domain] ?? NaN);
+      ws.send(reply);
+    } else {
+      console.log("Body:", data);
+    }
+  });
+  ws.on("close", () => {
+    sockets.delete(ws);
+    if (sockets.size === 0) units.delete(domain);
+    console.log(`Domain ${domain} | Push channel closed`);
+  });
+  ws.on("error", (err) => {
+    console.error(`Domain ${domain} | Push channel error:`, err);
+  });
+}
+
+// UDP telemetry on the HTTP port number, see firmware/src/telemetry.h.
+// Request: path length, URL path, frame. Reply: type, acked seq, fan power.
+const UDP_ACK = 1;
+const UDP_PUSH = 2;
+// Units that sent no datagram for this long no longer get pushes
+const UDP_UNIT_TIMEOUT = 60 * 1000;
+
+// UDP unit state, the last frame is kept to answer retransmissions
+type UdpUnit = Unit & {
+  address: string;
+  port: number;
+  seen: number;
+  seq?: number;
+  reply?: Buffer;
+};
+
+// UDP units per domain, by sender address and port
+const udpUnits: Map<string, Map<string, UdpUnit>> = new Map();
+const udpSocket = dgram.createSocket("udp4");
+
+function udpReply(type: number, seq: number, frame: Buffer) {
+  const header = Buffer.alloc(5);
+  header.writeUInt8(type, 0);
+  header.writeUInt32LE(seq, 1);
+  return Buffer.concat([header, frame]);
+}
+
+function handleDatagram(msg: Buffer, rinfo: dgram.RemoteInfo) {
+  const pathLength = msg.length > 0 ? msg.readUInt8(0) : 0;
+  const body = msg.subarray(1 + pathLength);
+  const match = /^\/unit\/([^/?]+)/.exec(
+    msg.subarray(1, 1 + pathLength).toString(),
+  );
+  if (!match || body.length < FRAME_HEADER_SIZE) return;
+  const domain = decodeURIComponent(match[1]);
+  const seq = body.readUInt32LE(10);
+  if (!udpUnits.has(domain)) udpUnits.set(domain, new Map());
+  const endpoints = udpUnits.get(domain)!;
+  const key = `${rinfo.address}:${rinfo.port}`;
+  let unit = endpoints.get(key);
+  if (!unit) {
+    unit = {
+      power: NaN,
+      channels: 1,
+      address: rinfo.address,
+      port: rinfo.port,
+      seen: 0,
+    };
+    endpoints.set(key, unit);
+    console.log(`Domain ${domain} | UDP unit ${key}`);
+  }
+  unit.seen = Date.now();
+  // Retransmission, the ack was lost
+  if (unit.seq === seq && unit.reply) {
+    udpSocket.send(unit.reply, rinfo.port, rinfo.address);
+    return;
+  }
+  const reply = handleTelemetry(domain, body, unit);
+  if (!reply) {
+    console.log("Malformed datagram from", key);
+    return;
+  }
+  unit.power = populationToFanPower(domains[domain] ?? NaN);
+  unit.seq = seq;
+  unit.reply = udpReply(UDP_ACK, seq, reply);
+  udpSocket.send(unit.reply, rinfo.port, rinfo.address);
+}
+
+function startUdpTelemetry() {
+  udpSocket.on("error", (err) =>
+    console.error("UDP telemetry socket error:", err),
+  );
+  udpSocket.on("message", handleDatagram);
+  udpSocket.bind(PORT);
+  setInterval(() => {
+    const now = Date.now();
+    for (const [domain, endpoints] of udpUnits) {
+      for (const [key, unit] of endpoints)
+        if (now - unit.seen > UDP_UNIT_TIMEOUT) endpoints.delete(key);
+      if (endpoints.size === 0) udpUnits.delete(domain);
+    }
+  }, UDP_UNIT_TIMEOUT);
+}
+
 // Timeout handle for clearing detections
 let detectionsTimeoutHandle: NodeJS.Timeout | null = null;
 
@@ -116,6 +336,7 @@ function resetDetectionsTimeout() {
     domains = {};
     status.clear();
     console.log("Detections cleared due to timeout");
+    pushFanPower();
     detectionsTimeoutHandle = null;
   }, detectionsTimeout);
 }
@@ -136,6 +357,7 @@ app.post("/detections", (req, res) => {
     }
     domains = detections;
     resetDetectionsTimeout(); // Reset timeout on new detections
+    pushFanPower(); // Push new setpoints to connected units
     res.status(200).end();
   } else {
     res
@@ -146,62 +368,377 @@ app.post("/detections", (req, res) => {
   }
 });
 
-app.post("/unit/:domain", (req, res) => {
+// Firmware images for OTA, served to units from var/firmware
+const FIRMWARE = path.join(VAR, "firmware");
+ensureDir(FIRMWARE);
+app.use("/firmware", express.static(FIRMWARE));
+
+// Tell the units of a domain to update from a URL, only reaches units with an
+// open push channel
+app.post("/ota/:domain", (req, res) => {
+  const domain = req.params.domain;
+  const url = req.body?.url;
+  if (typeof url !== "string" || !url.startsWith("http://")) {
+    res
+      .status(400)
+      .send('Bad Request: body must be {"url": "http://..."}.');
+    return;
+  }
+  const sockets = units.get(domain);
+  for (const ws of sockets?.keys() ?? []) ws.send(`ota ${url}`);
+  console.log(
+    `Domain ${domain} | OTA ${url} sent to ${sockets?.size ?? 0} unit(s)`,
+  );
+  res.json({ units: sockets?.size ?? 0 });
+});
+
+// Telemetry frame format, see firmware/src/frame.h
+const FRAME_MAGIC = 0xac5a;
+const FRAME_VERSION = 1;
+const FRAME_HEADER_SIZE = 18;
+const FRAME_NAN = -0x8000;
+const FRAME_STATUS = 1;
+const FRAME_BATCH = 2;
+const FLAG_FAN_STALLED = 1 << 0;
+const FLAG_LOCAL_CONTROL = 1 << 2;
+
+// Fixed-point fields by mask bit, unknown higher bits are skipped
+const FRAME_FIELDS = [
+  { name: "temperature", scale: 0.01 },
+  { name: "humidity", scale: 0.01 },
+  { name: "fan_rpm", scale: 1 },
+  { name: "fan_power", scale: 0.0001 },
+  { name: "flags", scale: 1 },
+  { name: "curve", scale: 1 },
+  { name: "heap_free_kb", scale: 1 },
+  { name: "heartbeat_failures", scale: 1 },
+  { name: "reconnects", scale: 1 },
+  { name: "post_ms", scale: 1 },
+  { name: "sensor_temperature", scale: 0.01 },
+  { name: "sensor_humidity", scale: 0.01 },
+  { name: "fan_rpm_1", scale: 1 },
+  { name: "fan_power_1", scale: 0.0001 },
+  { name: "fan_rpm_2", scale: 1 },
+  { name: "fan_power_2", scale: 0.0001 },
+] as const;
+
+// Fan channels a unit reports, channel 0 is sent as fan_rpm / fan_power
+const FAN_CHANNEL_FIELDS = [
+  ["fan_rpm", "fan_power"],
+  ["fan_rpm_1", "fan_power_1"],
+  ["fan_rpm_2", "fan_power_2"],
+] as const;
+
+type Fields = Partial<Record<(typeof FRAME_FIELDS)[number]["name"], number>>;
+
+type Sample = { uptime: number; fields: Fields };
+
+type Frame = {
+  type: number;
+  device: string;
+  seq: number;
+  uptime: number;
+  fields: Fields;
+  // Buffered samples of a batch frame
+  records: Sample[];
+};
+
+// Decode the fields selected by mask at offset, returns null if truncated
+function parseFields(body: Buffer, offset: number, mask: number) {
+  const fields: Fields = {};
+  for (let bit = 0; bit < 32; bit++) {
+    if (!(mask & (1 << bit))) continue;
+    if (offset + 2 > body.length) return null;
+    const raw = body.readInt16LE(offset);
+    offset += 2;
+    const field = FRAME_FIELDS[bit];
+    if (field) fields[field.name] = raw === FRAME_NAN ? NaN : raw * field.scale;
+  }
+  return { fields, offset };
+}
+
+// Decode a frame in place, returns null if malformed
+function parseFrame(body: Buffer): Frame | null {
+  if (body.length < FRAME_HEADER_SIZE + 4) return null;
+  if (body.readUInt16LE(0) !== FRAME_MAGIC) return null;
+  if (body.readUInt8(2) !== FRAME_VERSION) return null;
+  const frame: Frame = {
+    type: body.readUInt8(3),
+    device: body.subarray(4, 10).toString("hex"),
+    seq: body.readUInt32LE(10),
+    uptime: body.readUInt32LE(14),
+    fields: {},
+    records: [],
+  };
+  const mask = body.readUInt32LE(FRAME_HEADER_SIZE);
+  if (frame.type === FRAME_BATCH) {
+    // Shared mask, record count, base uptime, then delta-encoded records
+    if (body.length < FRAME_HEADER_SIZE + 10) return null;
+    const count = body.readUInt16LE(FRAME_HEADER_SIZE + 4);
+    let uptime = body.readUInt32LE(FRAME_HEADER_SIZE + 6);
+    let offset = FRAME_HEADER_SIZE + 10;
+    for (let i = 0; i < count; i++) {
+      if (offset + 2 > body.length) return null;
+      uptime = (uptime + body.readUInt16LE(offset)) >>> 0;
+      const parsed = parseFields(body, offset + 2, mask);
+      if (!parsed) return null;
+      frame.records.push({ uptime, fields: parsed.fields });
+      offset = parsed.offset;
+    }
+    return frame;
+  }
+  const parsed = parseFields(body, FRAME_HEADER_SIZE + 4, mask);
+  if (!parsed) return null;
+  frame.fields = parsed.fields;
+  return frame;
+}
+
+function historyFile(domain: string) {
+  return path.resolve(VAR, `domain-${normalizeFilenameComponent(domain)}.log`);
+}
+
+// Append samples a unit buffered during an outage to its history, device
+// uptime is mapped to wall clock through the batch send time
+// Sample uptimes recorded per device, oldest first. A leaf resends samples
+// whose reply it gave up on inside a later batch, under a new sequence
+// number, so batch records are matched against these instead.
+const RECORDED_SAMPLES = 1024;
+const recorded: Map<string, { order: number[]; uptimes: Set<number> }> =
+  new Map();
+
+// Returns false if the device already delivered the sample taken at uptime
+function markRecorded(device: string, uptime: number) {
+  let samples = recorded.get(device);
+  if (!samples) {
+    samples = { order: [], uptimes: new Set() };
+    recorded.set(device, samples);
+  }
+  if (samples.uptimes.has(uptime)) return false;
+  samples.uptimes.add(uptime);
+  samples.order.push(uptime);
+  if (samples.order.length > RECORDED_SAMPLES)
+    samples.uptimes.delete(samples.order.shift()!);
+  return true;
+}
+
+function handleBatch(domain: string, frame: Frame) {
+  const now = Date.now();
+  const records = frame.records.filter(({ uptime }) =>
+    markRecorded(frame.device, uptime),
+  );
+  const lines = records.map(({ uptime, fields }) => {
+    const timestamp = now - ((frame.uptime - uptime) >>> 0);
+    const { temperature, humidity, fan_rpm } = fields;
+    return [
+      timestamp.toString(),
+      JSON.stringify({ temperature, humidity, fan_rpm }, toFixed(2)),
+    ].join(",");
+  });
+  console.log(
+    `Domain ${domain} | Unit ${frame.device} uploaded ${lines.length} buffered sample(s)`,
+  );
+  if (lines.length === 0) return;
+  const db = historyFile(domain);
+  fs.appendFile(db, lines.map((l) => l + "\n").join(""), (err) => {
+    if (err) {
+      console.error(`Failed to write to log file ${db}:`, err);
+    }
+  });
+}
+
+// Last sequence number and uptime seen per device
+const sequences: Map<string, { seq: number; uptime: number }> = new Map();
+
+// Log dropped or reordered frames, returns true for a repeat of the last
+// frame, which is answered but not recorded again. UDP frames are resent
+// when the reply is late.
+function checkSequence(domain: string, frame: Frame) {
+  const last = sequences.get(frame.device);
+  if (last && frame.seq === last.seq && frame.uptime === last.uptime)
+    return true;
+  sequences.set(frame.device, { seq: frame.seq, uptime: frame.uptime });
+  if (!last) return false;
+  if (frame.seq === last.seq + 1) return false;
+  if (frame.seq < last.seq && frame.uptime < last.uptime) {
+    console.log(`Domain ${domain} | Unit ${frame.device} restarted`);
+    recorded.delete(frame.device);
+  } else if (frame.seq > last.seq) {
+    console.log(
+      `Domain ${domain} | Unit ${frame.device} lost ${frame.seq - last.seq - 1} frame(s)`,
+    );
+  } else {
+    console.log(
+      `Domain ${domain} | Unit ${frame.device} frame ${frame.seq} out of order (last ${last.seq})`,
+    );
+  }
+  return false;
+}
+
+// Device stats reported by units with perf telemetry enabled, by device id
+type Perf = {
+  domain: string;
+  heap_free_kb: number;
+  heartbeat_failures: number;
+  reconnects: number;
+  post_ms: number;
+  updated: number;
+};
+
+const perf: Map<string, Perf> = new Map();
+
+function updatePerf(domain: string, frame: Frame) {
+  const { heap_free_kb, heartbeat_failures, reconnects, post_ms } =
+    frame.fields;
+  if (heap_free_kb === undefined) return;
+  perf.set(frame.device, {
+    domain,
+    heap_free_kb,
+    // Counters wrap at 65536
+    heartbeat_failures: (heartbeat_failures ?? 0) & 0xffff,
+    reconnects: (reconnects ?? 0) & 0xffff,
+    post_ms: post_ms ?? NaN,
+    updated: Date.now(),
+  });
+}
+
+// Fan channels per device id, from its latest status frame
+const fan_channels: Map<string, number> = new Map();
+
+// Fan channel readings of a status frame, channel 0 first
+function fanChannels(fields: Fields) {
+  const fans = [];
+  for (const [rpm, power] of FAN_CHANNEL_FIELDS) {
+    if (fields[rpm] === undefined) break;
+    fans.push({ rpm: fields[rpm]!, power: fields[power] ?? NaN });
+  }
+  return fans;
+}
+
+// Handle one telemetry frame from an AC unit, returns the fan power reply or
+// null if the frame is malformed. Records the unit's fan channels on the push
+// channel state, if given.
+function handleTelemetry(
+  domain: string,
+  body: Buffer,
+  unit?: Unit,
+): Buffer | null {
   const timestamp = Date.now(); // Unix timestamp in milliseconds
+  let temperature: number, humidity: number, fan_rpm: number;
+  let fan_stalled: boolean | undefined;
+  let local_control: boolean | undefined;
+  let curve: number | undefined;
+  let sensors: Status["sensors"];
+  let fans: Status["fans"];
+  let channels = 1;
+  if (body.length === 12) {
+    // Legacy body, 3 raw floats
+    temperature = body.readFloatLE(0);
+    humidity = body.readFloatLE(4);
+    fan_rpm = body.readFloatLE(8);
+  } else {
+    const frame = parseFrame(body);
+    if (!frame) return null;
+    if (checkSequence(domain, frame))
+      return fanPowerFrame(
+        populationToFanPower(domains[domain] ?? NaN),
+        fan_channels.get(frame.device) ?? 1,
+      );
+    if (frame.type === FRAME_STATUS) {
+      const reported = fanChannels(frame.fields);
+      if (reported.length > 1) fans = reported;
+      fan_channels.set(frame.device, Math.max(reported.length, 1));
+    }
+    channels = fan_channels.get(frame.device) ?? 1;
+    if (unit) unit.channels = channels;
+    if (frame.type === FRAME_BATCH) {
+      handleBatch(domain, frame);
+      return fanPowerFrame(
+        populationToFanPower(domains[domain] ?? NaN),
+        channels,
+      );
+    }
+    if (frame.type !== FRAME_STATUS) return null;
+    temperature = frame.fields.temperature ?? NaN;
+    humidity = frame.fields.humidity ?? NaN;
+    fan_rpm = frame.fields.fan_rpm ?? NaN;
+    if (frame.fields.flags !== undefined) {
+      fan_stalled = (frame.fields.flags & FLAG_FAN_STALLED) !== 0;
+      local_control = (frame.fields.flags & FLAG_LOCAL_CONTROL) !== 0;
+    }
+    if (frame.fields.curve !== undefined) curve = frame.fields.curve & 0xffff;
+    if (frame.fields.sensor_temperature !== undefined)
+      sensors = [
+        { temperature, humidity },
+        {
+          temperature: frame.fields.sensor_temperature,
+          humidity: frame.fields.sensor_humidity ?? NaN,
+        },
+      ];
+    updatePerf(domain, frame);
+    markRecorded(frame.device, frame.uptime);
+  }
+  // Reply with fan power as binary float
+  const population = domains[domain] ?? NaN;
+  const power = populationToFanPower(population);
+
+  // Update status for this domain
+  updateStatus(domain, {
+    fan_power: power,
+    temperature,
+    humidity,
+    fan_rpm,
+    ...(fan_stalled !== undefined ? { fan_stalled } : {}),
+    ...(local_control !== undefined ? { local_control } : {}),
+    ...(sensors ? { sensors } : {}),
+    ...(fans ? { fans } : {}),
+  });
+
+  // Log received data
+  console.log(
+    `Domain ${domain}`,
+    `| Population: ${population}`,
+    `| Power: ${power.toFixed(2)}`,
+    `| Temperature: ${temperature.toFixed(2)}°C`,
+    `| Humidity: ${humidity.toFixed(2)}%`,
+    `| Fan RPM: ${fan_rpm.toFixed(2)}`,
+  );
+  // Append record to log file (optional)
+  const db = historyFile(domain);
+  const line = [
+    timestamp.toString(),
+    JSON.stringify({ temperature, humidity, fan_rpm, population }, toFixed(2)),
+  ].join(",");
+  fs.appendFile(db, line + "\n", (err) => {
+    if (err) {
+      console.error(`Failed to write to log file ${db}:`, err);
+    }
+  });
+  return fanPowerFrame(power, channels, curve);
+}
+
+// Fan power reply, one float per fan channel scaled by FAN_CHANNEL_SCALE,
+// followed by the fallback curve if the unit reported an outdated revision
+function fanPowerFrame(power: number, channels = 1, curve?: number) {
+  const buffer = Buffer.allocUnsafe(4 * channels);
+  for (let i = 0; i < channels; i++) {
+    const scale = channels > 1 ? (FAN_CHANNEL_SCALE[i] ?? 1) : 1;
+    buffer.writeFloatLE(Math.min(power * scale, 1), 4 * i);
+  }
+  if (curve === undefined || curve === FALLBACK_CURVE.revision) return buffer;
+  return Buffer.concat([buffer, fallbackCurveFrame()]);
+}
+
+app.post("/unit/:domain", (req, res) => {
   // Extract domain name from URL
   const domain = req.params.domain || "default";
   // Log body based on content type
   const contentType = req.headers["content-type"] || "";
-  if (
-    contentType.includes("application/octet-stream") &&
-    Buffer.isBuffer(req.body) &&
-    req.body.length >= 12
-  ) {
-    // Parse as floats for SmartAC telemetry
-    const temperature = req.body.readFloatLE(0);
-    const humidity = req.body.readFloatLE(4);
-    const fan_rpm = req.body.readFloatLE(8);
-    // Send response with fan power as binary float
-    const population = domains[domain] ?? NaN;
-    const responseBuffer = Buffer.allocUnsafe(4);
-    const power = populationToFanPower(population);
-    responseBuffer.writeFloatLE(power, 0);
-    res.type("application/octet-stream").send(responseBuffer);
-
-    // Update status for this domain
-    updateStatus(domain, {
-      fan_power: power,
-      temperature,
-      humidity,
-      fan_rpm,
-    });
-
-    // Log received data
-    console.log(
-      `Domain ${domain}`,
-      `| Population: ${population}`,
-      `| Power: ${power.toFixed(2)}`,
-      `| Temperature: ${temperature.toFixed(2)}°C`,
-      `| Humidity: ${humidity.toFixed(2)}%`,
-      `| Fan RPM: ${fan_rpm.toFixed(2)}`,
-    );
-    // Append record to log file (optional)
-    const db = path.resolve(
-      VAR,
-      `domain-${normalizeFilenameComponent(domain)}.log`,
-    );
-    const line = [
-      timestamp.toString(),
-      JSON.stringify(
-        { temperature, humidity, fan_rpm, population },
-        toFixed(2),
-      ),
-    ].join(",");
-    fs.appendFile(db, line + "\n", (err) => {
-      if (err) {
-        console.error(`Failed to write to log file ${db}:`, err);
-      }
-    });
+  const reply =
+    contentType.includes("application/octet-stream") && Buffer.isBuffer(req.body)
+      ? handleTelemetry(domain, req.body)
+      : null;
+  if (reply) {
+    res.type("application/octet-stream").send(reply);
   } else {
     // Bad request
     console.log("Body:", req.body);
@@ -209,6 +746,43 @@ app.post("/unit/:domain", (req, res) => {
   }
 });
 
+// Frames from ESP-NOW leaves, uploaded together by the unit forwarding them.
+// Request: per frame the path length, URL path, uint16 frame length and the
+// frame. Reply: per frame in the same order a uint16 length and the fan
+// power reply, length 0 for a frame that was rejected.
+app.post("/relay", (req, res) => {
+  const body = Buffer.isBuffer(req.body) ? req.body : Buffer.alloc(0);
+  const frames: { path: string; frame: Buffer }[] = [];
+  let offset = 0;
+  while (offset < body.length) {
+    const pathLength = body.readUInt8(offset);
+    const start = offset + 1 + pathLength + 2;
+    if (start > body.length) break;
+    const length = body.readUInt16LE(start - 2);
+    if (start + length > body.length) break;
+    frames.push({
+      path: body.subarray(offset + 1, offset + 1 + pathLength).toString(),
+      frame: body.subarray(start, start + length),
+    });
+    offset = start + length;
+  }
+  if (frames.length === 0 || offset !== body.length) {
+    console.log("Body:", req.body);
+    res.status(400).send("Bad Request");
+    return;
+  }
+  const replies = frames.map(({ path, frame }) => {
+    const match = /^\/unit\/([^/?]+)/.exec(path);
+    const reply = match
+      ? handleTelemetry(decodeURIComponent(match[1]), frame)
+      : null;
+    const length = Buffer.alloc(2);
+    length.writeUInt16LE(reply ? reply.length : 0);
+    return reply ? Buffer.concat([length, reply]) : length;
+  });
+  res.type("application/octet-stream").send(Buffer.concat(replies));
+});
+
 app.get("/status", (req, res) => {
   const keys = new Set([...status.keys(), ...Object.keys(domains)].sort());
   res.json(
@@ -224,6 +798,24 @@ app.get("/status", (req, res) => {
   );
 });
 
+app.get("/perf", (req, res) => {
+  const devices = [...perf.values()];
+  const sum = (key: "heartbeat_failures" | "reconnects" | "post_ms") =>
+    devices.reduce((total, d) => total + (isNaN(d[key]) ? 0 : d[key]), 0);
+  res.json({
+    devices: Object.fromEntries(perf),
+    fleet: {
+      units: devices.length,
+      min_heap_free_kb: devices.length
+        ? Math.min(...devices.map((d) => d.heap_free_kb))
+        : null,
+      heartbeat_failures: sum("heartbeat_failures"),
+      reconnects: sum("reconnects"),
+      mean_post_ms: devices.length ? sum("post_ms") / devices.length : NaN,
+    },
+  });
+});
+
 app.get("/history/:domain", (req, res) => {
   const domain = req.params.domain;
   const startParam = req.query.start as string | undefined;
@@ -250,10 +842,7 @@ app.get("/history/:domain", (req, res) => {
   }
 
   // Read log file for the domain
-  const logFile = path.resolve(
-    VAR,
-    `domain-${normalizeFilenameComponent(domain)}.log`,
-  );
+  const logFile = historyFile(domain);
 
   if (!fs.existsSync(logFile)) {
     res.status(404).send("Domain not exist");
@@ -263,7 +852,13 @@ app.get("/history/:domain", (req, res) => {
   try {
     // Stream and filter log file line by line
     const fileContent = fs.readFileSync(logFile, "utf-8");
-    const lines = fileContent.trim().split("\n");
+    // Backfilled samples are appended late, restore time order
+    const lines = fileContent
+      .trim()
+      .split("\n")
+      .map((line) => ({ line, time: parseFloat(line) }))
+      .sort((a, b) => a.time - b.time)
+      .map(({ line }) => line);
 
     const result: string[] = [];
     let lastTime = -Infinity;
@@ -320,7 +915,7 @@ app.get("/history/:domain", (req, res) => {
 // Catch-all route - serve static folder
 app.use(express.static(STATIC));
 
-app.listen(PORT, () => {
+const server = app.listen(PORT, () => {
   console.log(`Server listening on port ${PORT}`);
   console.log(`Detections timeout: ${detectionsTimeout / 1000}s`);
   const ips = getLocalIPs();
@@ -331,4 +926,24 @@ app.listen(PORT, () => {
   } else {
     console.log(`http://localhost:${PORT}`);
   }
+  startDiscovery();
+  console.log(`Announcing on UDP port ${DISCOVERY_PORT}`);
+  startUdpTelemetry();
+  console.log(`UDP telemetry on port ${PORT}`);
+});
+
+// Upgrade /unit/:domain to a WebSocket push channel
+const wss = new WebSocketServer({ noServer: true });
+server.on("upgrade", (req, socket, head) => {
+  const match = /^\/unit\/([^/?]+)/.exec(req.url ?? "");
+  if (!match) {
+    socket.destroy();
+    return;
+  }
+  const domain = decodeURIComponent(match[1]);
+  wss.handleUpgrade(req, socket, head, (ws) => attachUnit(domain, ws));
 });
+
+// Keep idle AC unit connections open between heartbeats (HTTP keep-alive)
+server.keepAliveTimeout = 60 * 1000;
+server.headersTimeout = 65 * 1000;